@@ -0,0 +1,36 @@
+#!/usr/bin/perl
+use 5.16.0;
+use warnings FATAL => 'all';
+
+# Runs the allocator microbenchmarks (bench_main.c) for every backend and
+# prints the per-operation counters side by side, as mean +- 95% CI.
+#
+#   perl bench.pl [RUNS]
+
+my $runs = shift // 10;
+my @backends = qw(sys hw7 par);
+my %results;
+my @rows;
+
+for my $be (@backends) {
+    my @lines = `./xmalloc-bench-$be $runs`;
+    die "xmalloc-bench-$be failed\n" if $?;
+    shift @lines;
+
+    for my $line (@lines) {
+        my ($op, $counter, $mean, $ci) = split ' ', $line;
+        my $row = "$op $counter";
+        push @rows, $row unless exists $results{$row};
+        $results{$row}{$be} = $mean eq "-" ? "-" : sprintf("%.2f +- %.2f", $mean, $ci);
+    }
+}
+
+printf("%-8s %-14s", "op", "counter");
+printf(" %20s", $_) for @backends;
+print "\n";
+
+for my $row (@rows) {
+    printf("%-8s %-14s", split(' ', $row));
+    printf(" %20s", $results{$row}{$_} // "?") for @backends;
+    print "\n";
+}
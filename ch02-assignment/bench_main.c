@@ -0,0 +1,350 @@
+// Allocator microbenchmarks with hardware performance counters.
+
+// Runs each backend's hot operations under perf_event_open counters
+// (cycles, instructions, L1D / LLC / dTLB misses, branch misses) and
+// reports every counter per operation as the mean over RUNS runs with a
+// 95% confidence interval. Counters the kernel or the machine doesn't
+// allow (see /proc/sys/kernel/perf_event_paranoid) are reported as "-";
+// wall time per operation is always measured. Only user space is
+// counted, so time spent in mmap and friends shows up in ns only.
+//
+// The counters are one group, led by the first that opens, so they count
+// over the same cycles and their ratios mean something. If the kernel
+// multiplexes the group with other events, counts are scaled up by
+// time_enabled / time_running. A PMU with too few counters free for the
+// whole group never schedules it; then each counter is opened on its own,
+// multiplexed and scaled the same way.
+//
+// One binary is linked per backend; bench.pl runs all three and puts
+// them side by side.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "xmalloc.h"
+
+#define MAX_RUNS 100
+
+typedef struct counter {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+    int fd;
+    int leader;  // fd of its group's leader
+    int slot;    // position in its group's read
+} counter;
+
+#define CACHE_MISS(cache, op) \
+    ((cache) | ((op) << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+counter counters[] = {
+    {"cycles",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1, -1, 0},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1, -1, 0},
+    {"l1d-misses",   PERF_TYPE_HW_CACHE,
+     CACHE_MISS(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ), -1, -1, 0},
+    {"llc-misses",   PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1, -1, 0},
+    {"dtlb-misses",  PERF_TYPE_HW_CACHE,
+     CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ), -1, -1, 0},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1, -1, 0},
+};
+
+#define COUNTERS ((int)(sizeof(counters) / sizeof(counters[0])))
+
+// What a read of a group leader returns (PERF_FORMAT_GROUP)
+typedef struct group_read {
+    uint64_t nr;
+    uint64_t time_enabled;
+    uint64_t time_running;
+    uint64_t values[COUNTERS];
+} group_read;
+
+// One benchmark: runs ops operations
+typedef struct bench {
+    const char* name;
+    long ops;
+    void (*run)(long ops);
+} bench;
+
+void* slots[4096];
+
+// Allocate and immediately free a small block
+void
+run_churn(long ops)
+{
+    for (long ii = 0; ii < ops; ++ii) {
+        void* pp = xmalloc(16 + (ii & 3) * 16);
+        *(volatile char*)pp = 1;
+        xfree(pp);
+    }
+}
+
+// Fill a table with small blocks, then free them all (list teardown);
+// an operation is one allocation plus one free
+void
+run_batch(long ops)
+{
+    for (long done = 0; done < ops; done += 4096) {
+        for (int ii = 0; ii < 4096; ++ii) {
+            slots[ii] = xmalloc(32);
+            *(volatile char*)slots[ii] = 1;
+        }
+        for (int ii = 0; ii < 4096; ++ii) {
+            xfree(slots[ii]);
+        }
+    }
+}
+
+// Grow an array by doubling, like ivec_push; an operation is one realloc
+void
+run_realloc(long ops)
+{
+    for (long done = 0; done < ops; done += 12) {
+        long* xs = xmalloc(4 * sizeof(long));
+        for (long cap = 8; cap <= 16384; cap *= 2) {
+            xs = xrealloc(xs, cap * sizeof(long));
+            xs[cap - 1] = cap;
+        }
+        xfree(xs);
+    }
+}
+
+// Zeroed page-sized blocks
+void
+run_calloc(long ops)
+{
+    for (long ii = 0; ii < ops; ++ii) {
+        char* pp = xcalloc(1, 4096);
+        pp[ii & 4095] = 1;
+        xfree(pp);
+    }
+}
+
+bench benches[] = {
+    {"churn",   1000000, run_churn},
+    {"batch",   1048576, run_batch},
+    {"realloc",   24000, run_realloc},
+    {"calloc",    20000, run_calloc},
+};
+
+#define BENCHES ((int)(sizeof(benches) / sizeof(benches[0])))
+
+// Opens a counter as the group leader (group -1) or as a member, which
+// starts and stops with its leader
+long
+perf_open(counter* cc, int group)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = cc->type;
+    attr.config = cc->config;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+        | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+// Opens every counter that the kernel allows, all in one group or each
+// in a group of its own
+void
+open_counters(int grouped)
+{
+    int leader = -1;
+    int size = 0;
+
+    for (int cc = 0; cc < COUNTERS; ++cc) {
+        counter* co = &(counters[cc]);
+        co->fd = perf_open(co, grouped ? leader : -1);
+        if (co->fd < 0) {
+            continue;
+        }
+
+        if (!grouped || leader < 0) {
+            leader = co->fd;
+            size = 0;
+        }
+        co->leader = leader;
+        co->slot = size++;
+    }
+}
+
+void
+close_counters()
+{
+    for (int cc = 0; cc < COUNTERS; ++cc) {
+        if (counters[cc].fd >= 0) {
+            close(counters[cc].fd);
+            counters[cc].fd = -1;
+        }
+    }
+}
+
+// Resets, enables or disables every group
+void
+control_counters(unsigned long request)
+{
+    for (int cc = 0; cc < COUNTERS; ++cc) {
+        if (counters[cc].fd >= 0 && counters[cc].fd == counters[cc].leader) {
+            ioctl(counters[cc].fd, request, PERF_IOC_FLAG_GROUP);
+        }
+    }
+}
+
+// Reads every group. Each counter gets its count scaled by time_enabled /
+// time_running, or -1 if it isn't open or its group never got onto the PMU.
+void
+read_counters(double* values)
+{
+    for (int cc = 0; cc < COUNTERS; ++cc) {
+        values[cc] = -1;
+    }
+
+    for (int cc = 0; cc < COUNTERS; ++cc) {
+        int leader = counters[cc].fd;
+        if (leader < 0 || leader != counters[cc].leader) {
+            continue;
+        }
+
+        group_read gr;
+        memset(&gr, 0, sizeof(gr));
+        if (read(leader, &gr, sizeof(gr)) <= 0 || gr.time_running == 0) {
+            continue;
+        }
+
+        double scale = (double)gr.time_enabled / gr.time_running;
+        for (int mm = 0; mm < COUNTERS; ++mm) {
+            if (counters[mm].fd >= 0 && counters[mm].leader == leader) {
+                values[mm] = gr.values[counters[mm].slot] * scale;
+            }
+        }
+    }
+}
+
+double
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Two sided 95% Student t quantiles for 1 .. 30 degrees of freedom
+static const double t95[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
+void
+report(const char* bench_name, const char* counter_name, double* xs, int runs)
+{
+    double sum = 0;
+    for (int ii = 0; ii < runs; ++ii) {
+        sum += xs[ii];
+    }
+    double mean = sum / runs;
+
+    double var = 0;
+    for (int ii = 0; ii < runs; ++ii) {
+        var += (xs[ii] - mean) * (xs[ii] - mean);
+    }
+
+    double ci = 0;
+    if (runs > 1) {
+        double tt = runs - 1 <= 30 ? t95[runs - 2] : 1.96;
+        ci = tt * sqrt(var / (runs - 1)) / sqrt(runs);
+    }
+
+    printf("%-8s %-14s %12.3f %10.3f\n", bench_name, counter_name, mean, ci);
+}
+
+int
+main(int argc, char* argv[])
+{
+    int runs = argc > 1 ? atoi(argv[1]) : 10;
+
+    if (argc > 2 || runs < 1 || runs > MAX_RUNS) {
+        printf("Usage:\n");
+        printf("\t%s [RUNS]\n", argv[0]);
+        printf("\tRUNS: 1 .. %d, default 10\n", MAX_RUNS);
+        return 1;
+    }
+
+    // Try the whole group on a short run first: six events may be more
+    // than the PMU has free (often four general counters, one of them
+    // held by the NMI watchdog), and such a group never runs at all
+    open_counters(1);
+    double probe[COUNTERS];
+    control_counters(PERF_EVENT_IOC_RESET);
+    control_counters(PERF_EVENT_IOC_ENABLE);
+    run_churn(10000);
+    control_counters(PERF_EVENT_IOC_DISABLE);
+    read_counters(probe);
+
+    for (int cc = 0; cc < COUNTERS; ++cc) {
+        if (counters[cc].fd >= 0 && probe[cc] < 0) {
+            close_counters();
+            open_counters(0);
+            break;
+        }
+    }
+
+    printf("%-8s %-14s %12s %10s\n", "op", "counter", "per-op", "ci95");
+
+    for (int bb = 0; bb < BENCHES; ++bb) {
+        bench* be = &(benches[bb]);
+        double ns[MAX_RUNS];
+        double counts[COUNTERS][MAX_RUNS];
+        int counted[COUNTERS];
+        for (int cc = 0; cc < COUNTERS; ++cc) {
+            counted[cc] = counters[cc].fd >= 0;
+        }
+
+        // Warm up: the first run pays for heap growth and page faults
+        be->run(be->ops / 10);
+
+        for (int rr = 0; rr < runs; ++rr) {
+            control_counters(PERF_EVENT_IOC_RESET);
+            control_counters(PERF_EVENT_IOC_ENABLE);
+
+            double t0 = now_ns();
+            be->run(be->ops);
+            ns[rr] = (now_ns() - t0) / be->ops;
+
+            double values[COUNTERS];
+            control_counters(PERF_EVENT_IOC_DISABLE);
+            read_counters(values);
+
+            // A counter that never got onto the PMU in some run isn't reported
+            for (int cc = 0; cc < COUNTERS; ++cc) {
+                if (values[cc] < 0) {
+                    counted[cc] = 0;
+                }
+                counts[cc][rr] = values[cc] / be->ops;
+            }
+        }
+
+        report(be->name, "ns", ns, runs);
+        for (int cc = 0; cc < COUNTERS; ++cc) {
+            if (counted[cc]) {
+                report(be->name, counters[cc].name, counts[cc], runs);
+            }
+            else {
+                printf("%-8s %-14s %12s %10s\n", be->name, counters[cc].name, "-", "-");
+            }
+        }
+    }
+
+    return 0;
+}
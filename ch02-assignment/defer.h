@@ -0,0 +1,92 @@
+#ifndef DEFER_H
+#define DEFER_H
+
+// Deferred, batched frees for the xmalloc backends.
+//
+// With XMALLOC_DEFER=N (at most DEFER_MAX), xfree only records the pointer
+// in a per-thread buffer. When N pointers have built up, on
+// xmalloc_flush(), or when the thread exits, the buffer is handed to the
+// backend's release function in one call, so the backend can free each
+// group of blocks under one lock. Unset or 0 frees immediately, and so
+// does any free while the process is under memory pressure (pressure.h).
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pressure.h"
+
+#define DEFER_MAX 1024
+
+typedef void (*defer_release_fn)(void** ptrs, int count);
+
+static int defer_limit = 0;
+static defer_release_fn defer_release = 0;
+static pthread_once_t defer_once = PTHREAD_ONCE_INIT;
+static pthread_key_t defer_key;
+static __thread void* defer_ptrs[DEFER_MAX];
+static __thread int defer_count = 0;
+
+static int defer_compare(const void* aa, const void* bb) {
+  uintptr_t xx = (uintptr_t)*(void* const*)aa;
+  uintptr_t yy = (uintptr_t)*(void* const*)bb;
+  return (xx > yy) - (xx < yy);
+}
+
+// For release functions that want the batch in address order
+static inline void defer_sort(void** ptrs, int count) {
+  qsort(ptrs, count, sizeof(void*), defer_compare);
+}
+
+// Releases everything this thread has deferred
+static inline void defer_flush() {
+  if (defer_count > 0) {
+    defer_release(defer_ptrs, defer_count);
+    defer_count = 0;
+  }
+}
+
+static void defer_thread_exit(void* unused) {
+  defer_flush();
+}
+
+static void defer_init() {
+  const char* value = getenv("XMALLOC_DEFER");
+  defer_limit = value ? atoi(value) : 0;
+  if (defer_limit > DEFER_MAX) {
+    defer_limit = DEFER_MAX;
+  }
+
+  int rv = pthread_key_create(&defer_key, defer_thread_exit);
+  assert(rv == 0);
+}
+
+// Returns 0 if deferral is off, and the caller should free ptr itself
+static inline int defer_free(void* ptr, defer_release_fn release) {
+  pthread_once(&defer_once, defer_init);
+
+  if (defer_limit <= 0 || ptr == 0) {
+    return 0;
+  }
+
+  if (pressure_active()) {
+    defer_flush();
+    return 0;
+  }
+
+  if (defer_count == 0) {
+    defer_release = release;
+    // Any non-null value makes the destructor run at thread exit
+    pthread_setspecific(defer_key, defer_ptrs);
+  }
+
+  defer_ptrs[defer_count++] = ptr;
+  if (defer_count >= defer_limit) {
+    defer_flush();
+  }
+
+  return 1;
+}
+
+#endif
@@ -0,0 +1,88 @@
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "heapdump.h"
+#include "xmalloc.h"
+
+static pthread_once_t heapdump_once = PTHREAD_ONCE_INIT;
+static sem_t requests;
+static const char* dump_path = 0;
+
+static void dump_now() {
+  if (strcmp(dump_path, "-") == 0) {
+    xmalloc_dump_heap(stderr);
+    return;
+  }
+
+  FILE* out = fopen(dump_path, "a");
+  if (out == 0) {
+    fprintf(stderr, "xmalloc: can't open %s for the heap dump\n", dump_path);
+    return;
+  }
+  xmalloc_dump_heap(out);
+  fclose(out);
+}
+
+static void on_signal(int sig) {
+  sem_post(&requests);
+}
+
+static void* dumper(void* unused) {
+  while (1) {
+    if (sem_wait(&requests) == 0) {
+      dump_now();
+    }
+  }
+  return 0;
+}
+
+static void start_dumper() {
+  dump_path = getenv("XMALLOC_DUMP");
+  if (dump_path == 0 || *dump_path == 0) {
+    return;
+  }
+
+  sem_init(&requests, 0, 0);
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int rv = pthread_create(&thread, &attr, dumper, 0);
+  pthread_attr_destroy(&attr);
+  if (rv != 0) {
+    fprintf(stderr, "xmalloc: can't start the heap dump thread\n");
+    return;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, 0);
+
+  atexit(dump_now);
+}
+
+void heapdump_start() {
+  pthread_once(&heapdump_once, start_dumper);
+}
+
+size_t heapdump_rss() {
+  long pages = 0;
+  long resident = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm) {
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(statm);
+  }
+  return resident * sysconf(_SC_PAGESIZE);
+}
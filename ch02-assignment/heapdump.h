@@ -0,0 +1,16 @@
+#ifndef HEAPDUMP_H
+#define HEAPDUMP_H
+
+// On-demand heap reports for the xmalloc backends.
+//
+// With XMALLOC_DUMP=path ("-" for stderr), xmalloc_dump_heap() appends
+// one line of JSON to path on every SIGUSR1 and once at exit. The signal
+// handler only posts a semaphore. A thread started for the purpose writes
+// the report, taking the allocator's locks like any other caller.
+
+// Installs the handler and starts the thread, once, if XMALLOC_DUMP is set
+void heapdump_start();
+// Resident set size of the process
+size_t heapdump_rss();
+
+#endif
@@ -1,11 +1,14 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/mman.h>
 #include <pthread.h>
 #include <string.h>
 
 #include "hmalloc.h"
+#include "heapdump.h"
 
 /*
   typedef struct hm_stats {
@@ -14,14 +17,43 @@
   long chunks_allocated;
   long chunks_freed;
   long free_length;
+  long heap_chunks;
+  long mappings;
+  long syscalls;
   } hm_stats;
 */
 
 const size_t PAGE_SIZE = 4096;
+// The heap grows by a chunk at a time, twice as big as the last one
+// until HEAP_CHUNK_MAX
+#define HEAP_CHUNK_MIN ((size_t)64 * 1024)
+#define HEAP_CHUNK_MAX ((size_t)4 * 1024 * 1024)
+// Free cell size buckets in hdump_heap: 16, 32, ... up to a chunk
+#define HEAP_CLASSES 19
+static size_t next_chunk = HEAP_CHUNK_MIN;
 static hm_stats stats;  // This initializes the stats to 0.
+static size_t heap_bytes = 0;  // mapped in heap chunks
 static size_t* free_list = 0;
 static pthread_mutex_t free_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Mappings in the whole process, as the kernel counts them (adjacent
+// mappings may have been merged)
+static long count_vmas() {
+  FILE* maps = fopen("/proc/self/maps", "r");
+  if (maps == 0) {
+    return -1;
+  }
+
+  long count = 0;
+  int cc;
+  while ((cc = fgetc(maps)) != EOF) {
+    count += cc == '\n';
+  }
+  fclose(maps);
+
+  return count;
+}
+
 long free_list_length() {
   long length = 0;
 
@@ -57,11 +89,57 @@ void hprintstats() {
   fprintf(stderr, "Allocs:   %ld\n", stats.chunks_allocated);
   fprintf(stderr, "Frees:    %ld\n", stats.chunks_freed);
   fprintf(stderr, "Freelen:  %ld\n", stats.free_length);
+  fprintf(stderr, "Chunks:   %ld\n", stats.heap_chunks);
+  fprintf(stderr, "Mappings: %ld\n", stats.mappings);
+  fprintf(stderr, "Syscalls: %ld\n", stats.syscalls);
+  fprintf(stderr, "VMAs:     %ld\n", count_vmas());
 
   rv = pthread_mutex_unlock(&free_list_mutex);
   assert(rv == 0);
 }
 
+// One JSON object: heap chunks and large mappings, the free list as a
+// histogram of cell sizes (powers of two from 16 bytes), and external
+// fragmentation as 1 - largest free cell / free bytes. Holds the free list
+// lock for one walk of the list.
+void hdump_heap(FILE* out) {
+  long sizes[HEAP_CLASSES] = {0};
+  long cells = 0;
+  size_t free_bytes = 0;
+  size_t largest = 0;
+
+  int rv = pthread_mutex_lock(&free_list_mutex);
+  assert(rv == 0);
+
+  for (size_t* current = free_list; current != 0; current = *((size_t**)current + 1)) {
+    int cls = 0;
+    while (cls + 1 < HEAP_CLASSES && ((size_t)32 << cls) <= *current) {
+      cls++;
+    }
+    sizes[cls]++;
+    cells++;
+    free_bytes += *current;
+    largest = *current > largest ? *current : largest;
+  }
+
+  size_t mapped = (stats.pages_mapped - stats.pages_unmapped) * PAGE_SIZE;
+  fprintf(out, "{\"backend\":\"hw7\",\"heap_chunks\":%ld,\"heap_bytes\":%zu,"
+          "\"large_bytes\":%zu,\"mappings\":%ld,\"free\":{\"cells\":%ld,\"bytes\":%zu,"
+          "\"largest\":%zu,\"sizes\":[", stats.heap_chunks, heap_bytes, mapped - heap_bytes,
+          stats.mappings, cells, free_bytes, largest);
+  for (int ii = 0; ii < HEAP_CLASSES; ii++) {
+    fprintf(out, "%s%ld", ii ? "," : "", sizes[ii]);
+  }
+
+  rv = pthread_mutex_unlock(&free_list_mutex);
+  assert(rv == 0);
+
+  fprintf(out, "]},\"summary\":{\"used_bytes\":%zu,\"free_bytes\":%zu,\"rss\":%zu,"
+          "\"external\":%.3f}}\n", heap_bytes - free_bytes, free_bytes, heapdump_rss(),
+          free_bytes ? 1.0 - (double)largest / free_bytes : 0);
+  fflush(out);
+}
+
 static size_t div_up(size_t xx, size_t yy) {
   // This is useful to calculate # of pages
   // for large allocations.
@@ -74,7 +152,9 @@ static size_t div_up(size_t xx, size_t yy) {
   }
 }
 
-void* hmalloc(size_t size) {
+// Allocates a block and reports whether it came straight from fresh
+// (zeroed) kernel pages rather than from the free list
+static void* halloc(size_t size, int* fresh) {
   int rv = pthread_mutex_lock(&free_list_mutex);
   assert(rv == 0);
 
@@ -91,20 +171,25 @@ void* hmalloc(size_t size) {
     }
 
     space = first_free(size);
+    *fresh = space == 0;
     
     if (space == 0) {
-      // No free cell available, allocate new page
-      space = mmap(free_list, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      // No free cell available: grow the heap by a chunk, carve the block
+      // from its start and put the rest on the free list
+      space = mmap(0, next_chunk, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
       assert(space != (void*)-1);
-      stats.pages_mapped++;
-      if (size <= PAGE_SIZE - 2 * sizeof(size_t)) {
-        // Leftover is enough for a free cell, allocated block is size specfied
-        size_t* free = (size_t*)((char*)space + size);
-        *free = PAGE_SIZE - size;
-        free_list_add(free);
-      } else {
-        // Leftover is not enough, allocated block is one page
-        size = PAGE_SIZE;
+      stats.pages_mapped += next_chunk / PAGE_SIZE;
+      heap_bytes += next_chunk;
+      stats.heap_chunks++;
+      stats.mappings++;
+      stats.syscalls++;
+
+      size_t* free = (size_t*)((char*)space + size);
+      *free = next_chunk - size;
+      free_list_add(free);
+
+      if (next_chunk < HEAP_CHUNK_MAX) {
+        next_chunk *= 2;
       }
     } else {
       // Free cell available
@@ -126,6 +211,9 @@ void* hmalloc(size_t size) {
     space = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     assert(space != (void*)-1);
     stats.pages_mapped += pages_needed;
+    stats.mappings++;
+    stats.syscalls++;
+    *fresh = 1;
   }
 
   rv = pthread_mutex_unlock(&free_list_mutex);
@@ -136,6 +224,26 @@ void* hmalloc(size_t size) {
   return (void*)((size_t*)space + 1);
 }
 
+void* hmalloc(size_t size) {
+  int fresh;
+  return halloc(size, &fresh);
+}
+
+void* hcalloc(size_t nmemb, size_t size) {
+  if (size != 0 && nmemb > SIZE_MAX / size) {
+    return 0;
+  }
+
+  int fresh;
+  void* item = halloc(nmemb * size, &fresh);
+
+  if (!fresh) {
+    memset(item, 0, nmemb * size);
+  }
+
+  return item;
+}
+
 void hfree(void* item) {
   int rv = pthread_mutex_lock(&free_list_mutex);
   assert(rv == 0);
@@ -152,48 +260,205 @@ void hfree(void* item) {
     int ret = munmap(block_start, item_size);
     assert(ret == 0);
     stats.pages_unmapped += item_size / PAGE_SIZE;
+    stats.mappings--;
+    stats.syscalls++;
+  }
+
+  rv = pthread_mutex_unlock(&free_list_mutex);
+  assert(rv == 0);
+}
+
+// Adds blocks sorted by address to the free list in one pass, resuming
+// each insertion where the last one stopped
+static void free_list_add_sorted(size_t** blocks, int count) {
+  size_t* prev = 0;
+  size_t* current = free_list;
+
+  for (int ii = 0; ii < count; ii++) {
+    size_t* block = blocks[ii];
+
+    while (current != 0 && current < block) {
+      prev = current;
+      current = *((size_t**)current + 1);
+    }
+
+    if (prev == 0) {
+      free_list = block;
+      join_free(block, current);
+      prev = block;
+    } else if (join_free(prev, block)) {
+      join_free(prev, current);
+    } else {
+      join_free(block, current);
+      prev = block;
+    }
+    current = *((size_t**)prev + 1);
+  }
+}
+
+// Frees items, sorted by address, under a single lock acquisition
+void hfree_batch(void** items, int count) {
+  size_t* blocks[count];
+  int small = 0;
+
+  int rv = pthread_mutex_lock(&free_list_mutex);
+  assert(rv == 0);
+
+  stats.chunks_freed += count;
+
+  for (int ii = 0; ii < count; ii++) {
+    size_t* block_start = (size_t*)items[ii] - 1;
+    size_t item_size = *(block_start);
+    if (item_size <= PAGE_SIZE) {
+      blocks[small++] = block_start;
+    } else {
+      int ret = munmap(block_start, item_size);
+      assert(ret == 0);
+      stats.pages_unmapped += item_size / PAGE_SIZE;
+      stats.mappings--;
+      stats.syscalls++;
+    }
   }
 
+  free_list_add_sorted(blocks, small);
+
   rv = pthread_mutex_unlock(&free_list_mutex);
   assert(rv == 0);
 }
 
+// Returns the whole pages inside each free cell to the kernel. The cell's
+// header page stays, and blocks cut from a cell are never assumed zeroed,
+// so nothing has to be rewritten.
+void htrim() {
+  int rv = pthread_mutex_lock(&free_list_mutex);
+  assert(rv == 0);
+
+  for (size_t* current = free_list; current != 0; current = *((size_t**)current + 1)) {
+    uintptr_t start = ((uintptr_t)(current + 2) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uintptr_t end = ((uintptr_t)current + *current) & ~(PAGE_SIZE - 1);
+    if (end > start) {
+      madvise((void*)start, end - start, MADV_DONTNEED);
+      stats.syscalls++;
+    }
+  }
+
+  rv = pthread_mutex_unlock(&free_list_mutex);
+  assert(rv == 0);
+}
+
+// Returns 1 if block is a cell on the free list
+static int free_list_contains(size_t* block) {
+  for (size_t* current = free_list; current != 0 && current <= block;
+       current = *((size_t**)current + 1)) {
+    if (current == block) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Resizes a block without moving it if it can, by splitting off its tail
+// or taking the front of a free cell right after it. Returns 0 if it can't.
+// Call with free_list_mutex held.
+static void* resize_in_place(size_t* block_start, size_t new_block_size) {
+  size_t item_size = *(block_start);
+
+  if (item_size > PAGE_SIZE) {
+    // Page spanning: let the kernel move or extend the mapping
+    if (new_block_size <= PAGE_SIZE) {
+      return 0;
+    }
+
+    size_t new_size = div_up(new_block_size, PAGE_SIZE) * PAGE_SIZE;
+    block_start = mremap(block_start, item_size, new_size, MREMAP_MAYMOVE);
+    assert(block_start != MAP_FAILED);
+    stats.syscalls++;
+    if (new_size > item_size) {
+      stats.pages_mapped += (new_size - item_size) / PAGE_SIZE;
+    } else {
+      stats.pages_unmapped += (item_size - new_size) / PAGE_SIZE;
+    }
+    *(block_start) = new_size;
+    return block_start + 1;
+  }
+
+  if (new_block_size < 2 * sizeof(size_t)) {
+    new_block_size = 2 * sizeof(size_t);
+  }
+
+  if (new_block_size <= item_size) {
+    if (item_size - new_block_size >= 2 * sizeof(size_t)) {
+      // Split off the tail as a free cell
+      *(block_start) = new_block_size;
+      size_t* new_free = (size_t*)((char*)block_start + new_block_size);
+      *(new_free) = item_size - new_block_size;
+      free_list_add(new_free);
+    }
+    return block_start + 1;
+  }
+
+  // Small blocks stay small: hfree decides unmapping by size
+  size_t* next = (size_t*)((char*)block_start + item_size);
+  if (new_block_size > PAGE_SIZE || !free_list_contains(next)
+      || item_size + *next < new_block_size) {
+    return 0;
+  }
+
+  size_t left = item_size + *next - new_block_size;
+  if (left < 2 * sizeof(size_t)) {
+    // Too little left for a free cell, take all of it
+    new_block_size = item_size + *next;
+    left = 0;
+    if (new_block_size > PAGE_SIZE) {
+      return 0;
+    }
+  }
+
+  free_list_remove(next, left);
+  *(block_start) = new_block_size;
+  return block_start + 1;
+}
+
 void* hrealloc(void* item, size_t size) {
+  if (item == 0) {
+    return hmalloc(size);
+  }
+
   int rv = pthread_mutex_lock(&free_list_mutex);
   assert(rv == 0);
 
   size_t* block_start = (size_t*)item - 1;
   size_t item_size = *(block_start);
-  size_t* new_item = item;
-  size_t new_block_size = size + sizeof(size_t);
-
-  if (new_block_size < item_size && item_size - new_block_size >= 2 * sizeof(size_t)) {
-    *(block_start) = new_block_size;
-    size_t* new_free = block_start + new_block_size;
-    *(new_free) = item_size - new_block_size;
-    free_list_add(new_free);
+  void* new_item = resize_in_place(block_start, size + sizeof(size_t));
 
-    rv = pthread_mutex_unlock(&free_list_mutex);
-    assert(rv == 0);
-  } else if (new_block_size > item_size) {
-    rv = pthread_mutex_unlock(&free_list_mutex);
-    assert(rv == 0);
+  rv = pthread_mutex_unlock(&free_list_mutex);
+  assert(rv == 0);
 
+  if (new_item == 0) {
     new_item = hmalloc(size);
-    memcpy(new_item, item, item_size - sizeof(size_t));
+    size_t keep = item_size - sizeof(size_t);
+    memcpy(new_item, item, keep < size ? keep : size);
     hfree(item);
   }
 
   return new_item;
 }
 
-// Returns the address of the first free block that is the size specified or greater
+// Returns the number of bytes usable in an allocated block (minus the size header)
+size_t husable_size(void* item) {
+  return *((size_t*)item - 1) - sizeof(size_t);
+}
+
+// Returns the address of the first free block that is the size specified or greater.
+// A cell too small to split is taken whole, so one that would make a block over
+// a page is skipped: hfree would unmap that block from the middle of its chunk.
 void* first_free(size_t size) {
   size_t* current_free = free_list;
   while (current_free != 0) {
     size_t free_size = *current_free;
     size_t* next = *((size_t**)current_free + 1);
-    if (size <= free_size) {
+    if (size <= free_size
+        && (free_size - size >= 2 * sizeof(size_t) || free_size <= PAGE_SIZE)) {
       return (void*)current_free;
     } else {
       current_free = next;
@@ -203,35 +468,10 @@ void* first_free(size_t size) {
   return (void*)current_free;
 }
 
-// Adds a block to the free list
+// Adds a block to the free list, keeping it in address order. A block
+// past the last cell is appended (this used to replace the whole list).
 void free_list_add(size_t* block) {
-  size_t* current = free_list;
-  while (current != 0) {
-    size_t* next = *((size_t**)current + 1);
-    if (current > block) {
-      // Block is the earliest in the list
-      free_list = block;
-      join_free(block, current);
-      return;
-    } else if (current < block && next > block) {
-      // Block goes in between the current and next blocks
-      int ret = join_free(current, block);
-      if (ret) {
-        // Block was coalesced with current
-        join_free(current, next);
-      } else {
-        // Block is separate
-        join_free(block, next);
-      }
-      return;
-    } else {
-      current = next;
-    }
-  }
-
-  // Default case, only used to insert first free cell
-  free_list = block;
-  *((size_t**)block + 1) = 0;
+  free_list_add_sorted(&block, 1);
 }
 
 
@@ -1,6 +1,8 @@
 #ifndef HMALLOC_H
 #define HMALLOC_H
 
+#include <stdio.h>
+
 // Husky Malloc Interface
 // cs3650 Starter Code
 
@@ -10,14 +12,24 @@ typedef struct hm_stats {
     long chunks_allocated;
     long chunks_freed;
     long free_length;
+    long heap_chunks;  // chunks mapped to grow the heap
+    long mappings;     // live mappings: heap chunks and large blocks
+    long syscalls;     // mmap, munmap and mremap calls
 } hm_stats;
 
 hm_stats* hgetstats();
 void hprintstats();
+// Heap occupancy as one line of JSON (see xmalloc_dump_heap)
+void hdump_heap(FILE* out);
 
 void* hmalloc(size_t size);
+void* hcalloc(size_t nmemb, size_t size);
 void hfree(void* item);
+void hfree_batch(void** items, int count);
 void* hrealloc(void* item, size_t size);
+size_t husable_size(void* item);
+// Hands free pages back to the kernel (see pressure.h)
+void htrim();
 
 void* first_free(size_t size);
 void free_list_add(size_t* block);
@@ -2,6 +2,10 @@
 #include <string.h>
 
 #include "hmalloc.h"
+#include "defer.h"
+#include "pressure.h"
+#include "heapdump.h"
+#include "trace.h"
 #include "xmalloc.h"
 
 /* CH02 TODO:
@@ -10,11 +14,51 @@
  */
 
 void* xmalloc(size_t bytes) {
-  return hmalloc(bytes);
+  void* ptr = hmalloc(bytes);
+  TRACE(TRACE_MALLOC, ptr, bytes);
+  return ptr;
 }
 
-void xfree(void* ptr) { hfree(ptr); }
+// Sorted, a batch goes into the address ordered free list in one pass
+static void release_sorted(void** ptrs, int count) {
+  defer_sort(ptrs, count);
+  hfree_batch(ptrs, count);
+}
+
+void xfree(void* ptr) {
+  TRACE(TRACE_FREE, ptr, 0);
+  if (!defer_free(ptr, release_sorted)) {
+    hfree(ptr);
+  }
+}
+
+void* xcalloc(size_t nmemb, size_t bytes) {
+  void* ptr = hcalloc(nmemb, bytes);
+  TRACE(TRACE_CALLOC, ptr, nmemb * bytes);
+  return ptr;
+}
 
 void* xrealloc(void* prev, size_t bytes) {
-  return hrealloc(prev, bytes);
+  TRACE(TRACE_REALLOC_FROM, prev, 0);
+  void* ptr = hrealloc(prev, bytes);
+  TRACE(TRACE_REALLOC_TO, ptr, bytes);
+  return ptr;
+}
+
+size_t xmalloc_usable_size(void* ptr) {
+  return husable_size(ptr);
+}
+
+void xmalloc_flush() {
+  defer_flush();
+}
+
+void xmalloc_dump_heap(FILE* out) {
+  hdump_heap(out);
+}
+
+__attribute__((constructor))
+static void start_monitors() {
+  pressure_start(htrim);
+  heapdump_start();
 }
@@ -2,6 +2,7 @@
 #define IVEC_H
 
 #include <assert.h>
+#include <string.h>
 
 #include "xmalloc.h"
 
@@ -63,4 +64,85 @@ ivec_copy(ivec* xs)
     return ys;
 }
 
+// Small-buffer ivec. The first SIVEC_INLINE items are stored in the header
+// itself (sized to fill a 256 byte block), so a short vector costs a single
+// allocation. Spilled storage is sized to whatever the allocator actually
+// handed back, and growth goes through xrealloc, which remaps rather than
+// copies once a vector spans whole pages.
+#define SIVEC_INLINE 29
+
+typedef struct sivec {
+    long  cap;
+    long  size;
+    long* data;
+    long  items[SIVEC_INLINE];
+} sivec;
+
+static
+sivec*
+make_sivec(long cap0)
+{
+    assert(cap0 > 0);
+
+    sivec* xs = xmalloc(sizeof(sivec));
+    xs->size = 0;
+
+    if (cap0 <= SIVEC_INLINE) {
+        xs->cap  = SIVEC_INLINE;
+        xs->data = xs->items;
+    }
+    else {
+        xs->data = xmalloc(cap0 * sizeof(long));
+        xs->cap  = xmalloc_usable_size(xs->data) / sizeof(long);
+    }
+
+    return xs;
+}
+
+static
+void
+free_sivec(sivec* xs)
+{
+    if (xs->data != xs->items) {
+        xfree(xs->data);
+    }
+    xfree(xs);
+}
+
+static
+void
+sivec_push(sivec* xs, long item)
+{
+    if (xs->size >= xs->cap) {
+        if (xs->data == xs->items) {
+            xs->data = xmalloc(2 * xs->cap * sizeof(long));
+            memcpy(xs->data, xs->items, xs->size * sizeof(long));
+        }
+        else {
+            xs->data = xrealloc(xs->data, 2 * xs->cap * sizeof(long));
+        }
+        xs->cap = xmalloc_usable_size(xs->data) / sizeof(long);
+    }
+
+    xs->data[xs->size] = item;
+    xs->size += 1;
+}
+
+static
+long
+sivec_last(sivec* xs)
+{
+    return xs->data[xs->size - 1];
+}
+
+static
+sivec*
+sivec_copy(sivec* xs)
+{
+    sivec* ys = make_sivec(xs->cap);
+    memcpy(ys->data, xs->data, xs->size * sizeof(long));
+    ys->size = xs->size;
+    return ys;
+}
+
 #endif
@@ -0,0 +1,228 @@
+// The Collatz conjecture, memoized.
+
+// Same search as list_main.c and ivec_main.c: the largest number of
+// steps to reach 1 for starting values from 2 to TOP. Rather than keep
+// every sequence, workers share a lock-free table of step counts that are
+// already known and stop iterating as soon as they reach one of them.
+//
+// The table is open-addressed with linear probing and lives in a fixed
+// memory budget. When it runs out of room new values are simply not
+// remembered, so answers stay exact and only the speedup degrades.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+
+#define THREADS 4
+
+// Default table budget in MB, overridden by the second argument
+#define MEMO_BUDGET_MB 512
+// Start values handed to a worker at a time
+#define CHUNK 4096
+// Give up on a lookup or insert after this many slots
+#define MAX_PROBE 16
+
+// A slot packs (value << STEP_BITS) | steps, with 0 meaning empty.
+// Values too large to pack are never stored.
+#define STEP_BITS 12
+#define MAX_KEY   ((1UL << (64 - STEP_BITS)) - 1)
+
+typedef struct result {
+    long value;
+    long steps;
+} result;
+
+uint64_t* table;
+int table_bits;
+long data_top = 0;
+long next_start = 2;
+// Once the table overflows, values from here up are neither stored nor
+// looked up. Start values are handed out in increasing order, so nearly
+// everything below it is already in the table.
+long memo_cutoff = LONG_MAX;
+
+static
+uint64_t
+slot_of(uint64_t key)
+{
+    return (key * 0x9E3779B97F4A7C15UL) >> (64 - table_bits);
+}
+
+// Returns the memoized step count for key, or -1 if it isn't known
+long
+memo_find(uint64_t key)
+{
+    uint64_t mask = (1UL << table_bits) - 1;
+    uint64_t ii = slot_of(key);
+
+    for (int pp = 0; pp < MAX_PROBE; ++pp) {
+        uint64_t entry = __atomic_load_n(&table[ii], __ATOMIC_RELAXED);
+        if (entry == 0) {
+            return -1;
+        }
+        if (entry >> STEP_BITS == key) {
+            return entry & ((1UL << STEP_BITS) - 1);
+        }
+        ii = (ii + 1) & mask;
+    }
+
+    return -1;
+}
+
+void
+memo_add(uint64_t key, long steps)
+{
+    uint64_t mask = (1UL << table_bits) - 1;
+    uint64_t ii = slot_of(key);
+    uint64_t entry = (key << STEP_BITS) | steps;
+
+    if (key > MAX_KEY || steps >= (1L << STEP_BITS)) {
+        return;
+    }
+
+    for (int pp = 0; pp < MAX_PROBE; ++pp) {
+        uint64_t seen = 0;
+        if (__atomic_compare_exchange_n(&table[ii], &seen, entry, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return;
+        }
+        if (seen >> STEP_BITS == key) {
+            return;
+        }
+        ii = (ii + 1) & mask;
+    }
+
+    // No room nearby: the table is effectively full. Only ever lower the
+    // cutoff, even when another thread lowers it at the same time.
+    long cutoff = __atomic_load_n(&memo_cutoff, __ATOMIC_RELAXED);
+    while ((long)key < cutoff
+           && !__atomic_compare_exchange_n(&memo_cutoff, &cutoff, key, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+long
+collatz_step(long n)
+{
+    if (n % 2 == 0) {
+        return n/2;
+    }
+    else {
+        return 3*n + 1;
+    }
+}
+
+// Counts steps from n down to 1, stopping early at the first smaller
+// value with a known count. Only odd start values are remembered: an even
+// n is always one step from n/2, which is smaller and looked up at once.
+long
+count_steps(long n)
+{
+    long steps = 0;
+    long vv = n;
+
+    long cutoff = __atomic_load_n(&memo_cutoff, __ATOMIC_RELAXED);
+
+    while (vv != 1) {
+        if (vv < n && vv < cutoff && vv % 2 == 1) {
+            long known = memo_find(vv);
+            if (known >= 0) {
+                steps += known;
+                break;
+            }
+        }
+
+        vv = collatz_step(vv);
+        steps++;
+    }
+
+    if (n % 2 == 1 && n < cutoff) {
+        memo_add(n, steps);
+    }
+
+    return steps;
+}
+
+void*
+worker(void* arg)
+{
+    result* best = arg;
+
+    while (1) {
+        long start = __atomic_fetch_add(&next_start, CHUNK, __ATOMIC_RELAXED);
+        if (start >= data_top) {
+            break;
+        }
+
+        long end = start + CHUNK < data_top ? start + CHUNK : data_top;
+        for (long ii = start; ii < end; ++ii) {
+            long steps = count_steps(ii);
+            if (steps > best->steps || (steps == best->steps && ii < best->value)) {
+                best->value = ii;
+                best->steps = steps;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    pthread_t threads[THREADS];
+    result best[THREADS];
+    int rv;
+
+    if (argc != 2 && argc != 3) {
+        printf("Usage:\n");
+        printf("\t%s TOP [BUDGET_MB]\n", argv[0]);
+        return 1;
+    }
+
+    data_top = atol(argv[1]);
+    long budget = argc == 3 ? atol(argv[2]) : MEMO_BUDGET_MB;
+
+    // Largest power of two number of slots that fits the budget,
+    // but no more than twice the number of odd start values
+    table_bits = 4;
+    while ((2UL << table_bits) * sizeof(uint64_t) <= budget * 1024UL * 1024UL
+           && (1L << table_bits) < data_top) {
+        table_bits++;
+    }
+
+    table = xcalloc(1UL << table_bits, sizeof(uint64_t));
+
+    for (int ii = 0; ii < THREADS; ++ii) {
+        best[ii].value = 0;
+        best[ii].steps = 0;
+        rv = pthread_create(&(threads[ii]), 0, worker, &(best[ii]));
+        assert(rv == 0);
+    }
+
+    for (int ii = 0; ii < THREADS; ++ii) {
+        rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+    }
+
+    long max_v = 0;
+    long max_s = 0;
+
+    for (int ii = 0; ii < THREADS; ++ii) {
+        if (best[ii].steps > max_s || (best[ii].steps == max_s && best[ii].value < max_v)) {
+            max_v = best[ii].value;
+            max_s = best[ii].steps;
+        }
+    }
+
+    printf("Max steps is at %ld: %ld steps\n", max_v, max_s);
+
+    xfree(table);
+
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 
 #include <assert.h>
 #include <stdio.h>
@@ -10,34 +11,217 @@
 #include <inttypes.h>
 
 #include "par_malloc.h"
+#include "par_numa.h"
+#include "par_pagemap.h"
+#include "par_persist.h"
+#include "par_tune.h"
+#include "pressure.h"
+#include "heapdump.h"
+#include "defer.h"
+#include "trace.h"
 #include "xmalloc.h"
 
-const size_t PAGE_SIZE = 1024000;
-static int arenas_init = 0;
-static arena arenas[4];
-static pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
-__thread int favorite_arena = 0;
+static pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+static arena anon_arenas[ARENAS];
+// Points into the heap file's superblock when the heap is persistent
+static arena* arenas = anon_arenas;
+static superblock* heap = 0;
+// -1 until the thread first picks an arena on its own NUMA node
+__thread int favorite_arena = -1;
+
+// Live large blocks, the bytes requested for them and the bytes mapped,
+// for xmalloc_dump_heap
+static long large_blocks = 0;
+static size_t large_requested = 0;
+static size_t large_mapped = 0;
+
+// Start of the slab reservation (ARENAS * 8 regions), or 0 if it couldn't
+// be made or the heap is persistent; slabs are then mapped one at a time
+// and found through the page map
+uint8_t* slab_space = 0;
+
+// Slab layout per size class and slab level, computed by init_geometry.
+// The bitmap is sized for the largest level, so the first block is at the
+// same offset in every slab of a class.
+static size_t page_maps[8][SLAB_LEVELS];  // 64 bit maps in the bitmap
+static uint64_t last_map[8][SLAB_LEVELS]; // initial value of the last map (tail bits used)
+static size_t data_offset[8];             // start of the first block, cache line aligned
+
+static int in_slab_space(void* ptr) {
+  return (uint8_t*)ptr >= slab_space
+    && (uint8_t*)ptr < slab_space + ((size_t)ARENAS * 8 << REGION_SHIFT);
+}
+
+// Classes below CACHE_LINE bytes hand each thread a whole line of blocks.
+// The blocks it hasn't used yet, and the ones it frees, are stacked here.
+__thread void* xcache_head[LINE_CLASSES];
+__thread int xcache_count[LINE_CLASSES];
+__thread int xcache_room = 0;
+static __thread int xcache_ready = 0;
+// Slow-path cache events this period, and how many of them were overflows
+static __thread int xcache_events = 0;
+static __thread int xcache_spills = 0;
+static pthread_key_t xcache_key;
+
+static void free_batch(void** ptrs, int count);
+static void release_sorted(void** ptrs, int count);
+
+static void xcache_push(int cls, void* ptr) {
+  *(void**)ptr = xcache_head[cls];
+  xcache_head[cls] = ptr;
+  xcache_count[cls]++;
+}
+
+static void* xcache_pop(int cls) {
+  void* ptr = xcache_head[cls];
+  xcache_head[cls] = *(void**)ptr;
+  xcache_count[cls]--;
+  return ptr;
+}
+
+// Returns count blocks from the top of a stack to their slabs
+static void xcache_spill(int cls, int count) {
+  if (count <= 0) {
+    return;
+  }
+
+  void* ptrs[count];
+  for (int ii = 0; ii < count; ii++) {
+    ptrs[ii] = xcache_pop(cls);
+  }
+  free_batch(ptrs, count);
+}
+
+// Resizes the thread's caches every TUNE_PERIOD misses and overflows
+static void xcache_tick(int spilled) {
+  xcache_spills += spilled;
+  if (++xcache_events < TUNE_PERIOD) {
+    return;
+  }
+
+  xcache_room = tune_cache_room(xcache_room, xcache_spills);
+  xcache_events = 0;
+  xcache_spills = 0;
+}
+
+static void xcache_thread_exit(void* unused) {
+  for (int cls = 0; cls < LINE_CLASSES; cls++) {
+    xcache_spill(cls, xcache_count[cls]);
+  }
+}
+
+static void xcache_setup() {
+  if (!xcache_ready) {
+    pthread_once(&arenas_once, init_arenas);
+    xcache_ready = 1;
+    // Any non-null value makes the destructor run at thread exit
+    pthread_setspecific(xcache_key, xcache_head);
+    xcache_room = slab_space && !trace_enabled() ? tune.cache : 0;
+  }
+}
+
+void* xmalloc_slow(size_t bytes) {
+  void* ptr = opt_malloc(bytes);
+  TRACE(TRACE_MALLOC, ptr, bytes);
+  return ptr;
+}
+
+void xfree_slow(void* ptr) {
+  xcache_setup();
+  TRACE(TRACE_FREE, ptr, 0);
+
+  uintptr_t off = (uint8_t*)ptr - slab_space;
+  int cls = (off >> REGION_SHIFT) % 8;
+  if (xcache_room > 0 && in_slab_space(ptr) && cls < LINE_CLASSES) {
+    if (xcache_count[cls] >= xcache_room) {
+      xcache_spill(cls, xcache_count[cls] - xcache_room / 2);
+      xcache_tick(1);
+    }
+    xcache_push(cls, ptr);
+    return;
+  }
+
+  if (!defer_free(ptr, release_sorted)) {
+    opt_free(ptr);
+  }
+}
 
 void* xmalloc(size_t bytes) {
-  return opt_malloc(bytes);
+  return xmalloc_slow(bytes);
+}
+
+void xfree(void* ptr) {
+  xfree_slow(ptr);
 }
 
-void xfree(void* ptr) { 
-  opt_free(ptr);
+void* xcalloc(size_t nmemb, size_t bytes) {
+  void* ptr = opt_calloc(nmemb, bytes);
+  TRACE(TRACE_CALLOC, ptr, nmemb * bytes);
+  return ptr;
 }
 
 void* xrealloc(void* prev, size_t bytes) {
-  return opt_realloc(prev, bytes);
+  TRACE(TRACE_REALLOC_FROM, prev, 0);
+  void* ptr = opt_realloc(prev, bytes);
+  TRACE(TRACE_REALLOC_TO, ptr, bytes);
+  return ptr;
+}
+
+size_t xmalloc_usable_size(void* ptr) {
+  return get_block_size(ptr);
+}
+
+void xmalloc_flush() {
+  defer_flush();
+  xcache_thread_exit(0);
+}
+
+static void* alloc_block(size_t bytes, int* fresh);
+static void count_large(size_t bytes, int sign);
+
+// Maps fresh, zeroed memory for a slab or a large block, from the heap
+// file when the heap is persistent
+static void* map_memory(size_t bytes) {
+  if (heap) {
+    return persist_alloc(heap, bytes);
+  }
+
+  void* mem = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(mem != MAP_FAILED);
+  return mem;
 }
 
 void* opt_malloc(size_t bytes) {
-  if (!arenas_init) {
-    init_arenas();
+  int fresh;
+  return alloc_block(bytes, &fresh);
+}
+
+void* opt_calloc(size_t nmemb, size_t bytes) {
+  if (bytes != 0 && nmemb > SIZE_MAX / bytes) {
+    return 0;
+  }
+
+  int fresh;
+  void* ret = alloc_block(nmemb * bytes, &fresh);
+
+  if (ret != 0 && !fresh) {
+    memset(ret, 0, nmemb * bytes);
   }
 
+  return ret;
+}
+
+// Allocates a block and reports whether it is still zero, i.e. has never
+// been handed out since its slab or mapping came from the kernel
+static void* alloc_block(size_t bytes, int* fresh) {
+  pthread_once(&arenas_once, init_arenas);
+
   if (bytes == 0)
     return 0;
 
+  PROF_START();
+  void* ret;
+
   if (bytes <= 2048) {
     size_t mask = 0x800;
     int target_bucket = 7;
@@ -49,68 +233,189 @@ void* opt_malloc(size_t bytes) {
 
     target_bucket = bytes > mask ? target_bucket + 1 : target_bucket;
 
+    if (target_bucket < LINE_CLASSES && xcache_head[target_bucket]) {
+      // A block this thread freed, or the next one of a line it owns
+      ret = xcache_pop(target_bucket);
+      *fresh = 0;
+      PROF_END(target_bucket);
+      return ret;
+    }
+
+    if (target_bucket < LINE_CLASSES && xcache_room > 0) {
+      xcache_tick(0);
+    }
+
+    // Blocks smaller than a cache line are claimed a whole line at a time,
+    // except while tracing: stacked blocks can be handed out inline,
+    // where they wouldn't be recorded
+    int run = target_bucket < LINE_CLASSES && !trace_enabled()
+      ? CACHE_LINE >> (4 + target_bucket) : 1;
+
     lock_arena();
 
-    bucket* bucket_found = arenas[favorite_arena].buckets[target_bucket];
-    void* ret = first_free_block(bucket_found);
+    ret = first_free_block(&arenas[favorite_arena], target_bucket, &run, fresh);
 
     unlock_arena();
-    return ret;
+
+    if (run > 1) {
+      xcache_setup();
+      for (int ii = run - 1; ii > 0; ii--) {
+        xcache_push(target_bucket, (uint8_t*)ret + ii * ((size_t)16 << target_bucket));
+      }
+    }
+
+    PROF_END(target_bucket);
   } else {
-    unlock_arena();
-    size_t* largeMem = mmap(0, bytes + sizeof(size_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    assert(largeMem > 0);
+    PROF_PATH(PATH_MMAP);
+    size_t* largeMem = map_memory(bytes + sizeof(size_t));
     *largeMem = bytes;
-    return (void*)(largeMem + 1);
+    count_large(bytes, 1);
+    // Only the first page is registered: every pointer handed back to
+    // free or realloc is the one returned here
+    pagemap_set(largeMem, 1, (uintptr_t)largeMem | MAP_LARGE);
+    ret = (void*)(largeMem + 1);
+    *fresh = 1;
+    PROF_END(PROF_LARGE);
   }
+
+  return ret;
 }
 
-void* first_free_block(bucket* b) {
-  int rv = pthread_mutex_lock(&b->mutex);
-  assert(rv == 0);
-  size_t block_size = b->size;
-  size_t blockIdx = 0;
+// Finds the first aligned group of run free blocks in a bitmap word
+// Returns the bit index of the group, or -1 if there is none
+static int find_run(uint64_t map, int run) {
+  uint64_t used = map;
+  uint64_t starts = ~0UL;
+
+  if (run == 2) {
+    used |= map >> 1;
+    starts = 0x5555555555555555UL;
+  } else if (run == 4) {
+    used |= map >> 1 | map >> 2 | map >> 3;
+    starts = 0x1111111111111111UL;
+  }
+
+  uint64_t open = ~used & starts;
+  return open ? __builtin_ctzll(open) : -1;
+}
+
+// Maps and initializes a slab of the given level for a size class.
+// Called with the arena locked. Once the class's region is used up, slabs
+// are mapped one at a time and found through the page map, as they are
+// without a reservation.
+static bucket* new_slab(arena* a, int cls, int level) {
+  bucket* slab;
+
+  if (slab_space && a->slabs[cls] < REGION_SLABS) {
+    // Next SLAB_SPAN slot of the class's region; the rest of the slot
+    // stays inaccessible
+    size_t region = (size_t)((a - arenas) * 8 + cls) << REGION_SHIFT;
+    slab = (bucket*)(slab_space + region + a->slabs[cls]++ * SLAB_SPAN);
+    int rv = mprotect(slab, SLAB_MIN << level, PROT_READ | PROT_WRITE);
+    assert(rv == 0);
+  } else {
+    slab = map_memory(SLAB_MIN << level);
+    pagemap_set(slab, SLAB_MIN << level, (uintptr_t)slab);
+  }
+
+  numa_bind(slab, SLAB_MIN << level, a->node);
+  tune_slab_mapped(SLAB_MIN << level);
+  init_page(cls, level, slab);
+  return slab;
+}
+
+// Claims *run adjacent blocks (one whole cache line for small classes) from
+// the arena's chain for a size class. If the chain has no free line left,
+// falls back to a single block before mapping a new slab, and sets *run
+// to 1. *fresh is set if the blocks have never been handed out before.
+//
+// Slabs are created on first use, at the first slab size (PAR_CONFIG
+// slab=), and each slab added to a chain is twice the size of the last, up
+// to SLAB_MIN << (SLAB_LEVELS - 1), unless tune_next_level holds it back.
+//
+// The search starts past the slabs at the front of the chain that were
+// full last time (a->open), so a long chain of small slabs isn't walked
+// on every call; any free in the class sends it back to the head.
+void* first_free_block(arena* a, int blockIdx, int* run, int* fresh) {
+  bucket* b = a->buckets[blockIdx];
   uint8_t* ret = 0;
 
-  while (block_size != 16) {
-    blockIdx++;
-    block_size >>= 1;
+  if (b == 0) {
+    PROF_PATH(PATH_SLAB);
+    b = new_slab(a, blockIdx, tune.slab_level);
+    __atomic_store_n(&a->buckets[blockIdx], b, __ATOMIC_RELEASE);
   }
 
+  bucket* open = __atomic_load_n(&a->open[blockIdx], __ATOMIC_RELAXED);
+  b = open ? open : b;
+  bucket* head = b;
+  int full = 1;  // every slab passed so far is full
+  int rv = PROF_LOCK(&b->mutex, &a->bucket_locks[blockIdx]);
+  assert(rv == 0);
+
   while (!ret) {
     uint64_t* mapStart = (uint64_t*)(b + 1);
+    uint64_t group = (1UL << *run) - 1;
 
-    for (int ii = 0; ii < pageMaps[blockIdx]; ii++) {
-      if (*(mapStart + ii) != UINT64_MAX) {
-        int bitIdx = 0;
-        uint64_t mask = 1;
+    int maps = page_maps[blockIdx][b->level];
+    int nonfull = maps;
 
-        while (*(mapStart + ii) & mask) {
-          bitIdx++;
-          mask <<= 1;
+    for (int ii = b->hint; ii < maps; ii++) {
+      if (*(mapStart + ii) != UINT64_MAX) {
+        if (nonfull == maps) {
+          nonfull = ii;
         }
 
-        ret = (uint8_t*)(mapStart + pageMaps[blockIdx]) + bitIdx * b->size + ii * 64 * b->size;
-        *(mapStart + ii) |= mask;
-        break;
+        int bitIdx = find_run(*(mapStart + ii), *run);
+
+        if (bitIdx >= 0) {
+          size_t index = ii * 64 + bitIdx;
+          ret = (uint8_t*)b + data_offset[blockIdx] + index * b->size;
+          *(mapStart + ii) |= group << bitIdx;
+          *fresh = index >= b->touched;
+          if (index + *run > b->touched) {
+            b->touched = index + *run;
+          }
+          break;
+        }
       }
     }
 
+    // Skip the maps that were full next time
+    b->hint = nonfull;
+
     if (!ret) {
       if (b->next_page) {
+        PROF_PATH(PATH_SCAN);
         bucket* nextPage = b->next_page;
-        rv = pthread_mutex_lock(&nextPage->mutex);
+        full = full && nonfull == maps;
+        if (full) {
+          __atomic_store_n(&a->open[blockIdx], nextPage, __ATOMIC_RELAXED);
+        }
+        rv = PROF_LOCK(&nextPage->mutex, &a->bucket_locks[blockIdx]);
         assert(rv == 0);
         rv = pthread_mutex_unlock(&b->mutex);
         assert(rv == 0);
         b = nextPage;
+      } else if (*run > 1) {
+        // Only partial lines are left, take any single free block
+        PROF_PATH(PATH_SCAN);
+        *run = 1;
+        full = 1;
+        rv = pthread_mutex_unlock(&b->mutex);
+        assert(rv == 0);
+        b = head;
+        rv = PROF_LOCK(&b->mutex, &a->bucket_locks[blockIdx]);
+        assert(rv == 0);
       } else {
-        bucket* newBucket = mmap(0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        assert(newBucket > 0);
-        init_page(b->size, newBucket);
-        b->next_page = newBucket;
-        *((uint64_t*)(newBucket + 1)) = 1;
-        ret = (uint8_t*)((uint64_t*)(newBucket + 1) + pageMaps[blockIdx]);
+        // Busy class: add a slab twice as big as the last one
+        PROF_PATH(PATH_SLAB);
+        bucket* newBucket = new_slab(a, blockIdx, tune_next_level(b->level));
+        *((uint64_t*)(newBucket + 1)) |= group;
+        newBucket->touched = *run;
+        __atomic_store_n(&b->next_page, newBucket, __ATOMIC_RELEASE);
+        *fresh = 1;
+        ret = (uint8_t*)newBucket + data_offset[blockIdx];
       }
     }
   }
@@ -121,31 +426,145 @@ void* first_free_block(bucket* b) {
   return (void*)ret;
 }
 
+// Large blocks are whole mappings with the requested size stored in front
+static size_t large_map_size(size_t bytes) {
+  return (bytes + sizeof(size_t) + 4095) & ~(size_t)4095;
+}
+
+static void count_large(size_t bytes, int sign) {
+  __atomic_add_fetch(&large_blocks, sign, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&large_requested, sign * bytes, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&large_mapped, sign * large_map_size(bytes), __ATOMIC_RELAXED);
+}
+
+// Returns blocks of one slab to its bitmap under one lock acquisition,
+// and lowers the slab's hint so the next scan finds the free maps.
+// a is the owning arena, if known.
+static void free_blocks(arena* a, bucket* b, int cls, void** ptrs, int count) {
+  // The slab may come before where searches start now; without the arena
+  // (persistent heap slabs), send every arena's search back to the head
+  for (int ii = a ? a - arenas : 0; ii < (a ? a - arenas + 1 : ARENAS); ii++) {
+    if (__atomic_load_n(&arenas[ii].open[cls], __ATOMIC_RELAXED)) {
+      __atomic_store_n(&arenas[ii].open[cls], 0, __ATOMIC_RELAXED);
+    }
+  }
+
+  int rv = a ? PROF_LOCK(&b->mutex, &a->bucket_locks[cls]) : pthread_mutex_lock(&b->mutex);
+  assert(rv == 0);
+
+  for (int ii = 0; ii < count; ii++) {
+    size_t index = ((uint8_t*)ptrs[ii] - ((uint8_t*)b + data_offset[cls])) >> (4 + cls);
+    uint64_t* map = (uint64_t*)(b + 1) + index / 64;
+    uint64_t bit = 1UL << (index % 64);
+
+    assert(*map & bit);  // double free
+    *map &= ~bit;
+    if (index / 64 < b->hint) {
+      b->hint = index / 64;
+    }
+  }
+
+  rv = pthread_mutex_unlock(&b->mutex);
+  assert(rv == 0);
+}
+
 void opt_free(void* ptr) {
-  // bucket* closest = closest_bucket(ptr);
+  if (ptr == 0) {
+    return;
+  }
 
-  // if (closest != 0) {
-  //   void* mem_start = (void*)(closest + 1);
-  //   size_t index = (ptr - mem_start) / closest->size;
-  //   int offset = index / 64;
-  //   uint64_t mask = ~(uint64_t)(pow(2, (index % 64)));
-  //   // printf("%p %p %ld %d\n", ptr, mem_start, index, offset);
-  //   int rv = pthread_mutex_lock(&(closest->mutex));
-  //   assert(rv == 0);
+  PROF_START();
+  PROF_PATH(PATH_FREE);
 
-  //   closest->map[offset] = closest->map[offset] & mask; 
+  if (in_slab_space(ptr)) {
+    size_t region = ((uint8_t*)ptr - slab_space) >> REGION_SHIFT;
+    bucket* b = (bucket*)((uintptr_t)ptr & ~(SLAB_SPAN - 1));
+    free_blocks(&arenas[region / 8], b, region % 8, &ptr, 1);
+    PROF_END(PROF_ANY);
+    return;
+  }
 
-  //   rv = pthread_mutex_unlock(&(closest->mutex));
-  //   assert(rv == 0);
-  // } else {
-  //   free(ptr);
-  // }
+  uintptr_t entry = pagemap_get(ptr);
+
+  if (entry & MAP_LARGE) {
+    size_t* largeMem = (size_t*)(entry & ~MAP_LARGE);
+    // Unregister first: once unmapped, the range can be handed out again
+    pagemap_set(largeMem, 1, 0);
+    count_large(*largeMem, -1);
+    if (persist_contains(heap, largeMem)) {
+      persist_free(heap, largeMem, large_map_size(*largeMem));
+    } else {
+      munmap(largeMem, large_map_size(*largeMem));
+    }
+  } else if (entry != 0) {
+    // A slab outside the reservation (persistent heap or fallback mapping)
+    bucket* b = (bucket*)entry;
+    free_blocks(0, b, __builtin_ctzll(b->size) - 4, &ptr, 1);
+  } else if (persist_contains(heap, ptr)) {
+    // A large block allocated by an earlier run, which the page map
+    // doesn't know about: its size sits in front, at a page boundary
+    size_t* largeMem = (size_t*)ptr - 1;
+    assert(((uintptr_t)largeMem & 4095) == 0);
+    persist_free(heap, largeMem, large_map_size(*largeMem));
+  }
+
+  PROF_END(PROF_ANY);
+}
+
+// Releases a batch of frees. Each run of blocks from the same slab slot
+// is freed under one lock.
+static void free_batch(void** ptrs, int count) {
+  int ii = 0;
+
+  while (ii < count) {
+    if (!in_slab_space(ptrs[ii])) {
+      opt_free(ptrs[ii++]);
+      continue;
+    }
+
+    uintptr_t slot = (uintptr_t)ptrs[ii] & ~(SLAB_SPAN - 1);
+    int run = 1;
+    while (ii + run < count && ((uintptr_t)ptrs[ii + run] & ~(SLAB_SPAN - 1)) == slot) {
+      run++;
+    }
+
+    PROF_START();
+    PROF_PATH(PATH_FREE);
+    size_t region = ((uint8_t*)slot - slab_space) >> REGION_SHIFT;
+    free_blocks(&arenas[region / 8], (bucket*)slot, region % 8, ptrs + ii, run);
+    PROF_END(PROF_ANY);
+    ii += run;
+  }
+}
+
+// Sorted, a deferred batch has one run per slab it touches
+static void release_sorted(void** ptrs, int count) {
+  defer_sort(ptrs, count);
+  free_batch(ptrs, count);
 }
 
 void* opt_realloc(void* prev, size_t bytes) {
-    void* new_block = opt_malloc(bytes);
+    if (prev == 0) {
+      return opt_malloc(bytes);
+    }
+
     size_t prev_size = get_block_size(prev);
 
+    if (prev_size > 2048 && bytes > 2048 && !persist_contains(heap, prev)) {
+      // Large to large: remap the pages rather than copying them
+      size_t* largeMem = (size_t*)prev - 1;
+      pagemap_set(largeMem, 1, 0);
+      count_large(*largeMem, -1);
+      count_large(bytes, 1);
+      largeMem = mremap(largeMem, large_map_size(*largeMem), large_map_size(bytes), MREMAP_MAYMOVE);
+      assert(largeMem != MAP_FAILED);
+      *largeMem = bytes;
+      pagemap_set(largeMem, 1, (uintptr_t)largeMem | MAP_LARGE);
+      return (void*)(largeMem + 1);
+    }
+
+    void* new_block = opt_malloc(bytes);
+
     if (bytes <= prev_size || prev_size == 0) {
       memcpy(new_block, prev, bytes);
     } else {
@@ -157,83 +576,279 @@ void* opt_realloc(void* prev, size_t bytes) {
 }
 
 size_t get_block_size(void* ptr) {
-  return closest_bucket(ptr)->size;
+  if (in_slab_space(ptr)) {
+    size_t region = ((uint8_t*)ptr - slab_space) >> REGION_SHIFT;
+    return (size_t)16 << (region % 8);
+  }
+
+  bucket* b = closest_bucket(ptr);
+
+  if (b == 0) {
+    // Not in any slab, so it's a large block
+    return large_map_size(*((size_t*)ptr - 1)) - sizeof(size_t);
+  }
+
+  return b->size;
 }
 
+// The slab holding ptr, or 0 for a large block
 bucket* closest_bucket(void* ptr) {
-  for (int ii = 0; ii < 4; ii++) {
-    arena cur_arena = arenas[ii];
-    for (int jj = 0; jj < 8; jj++) {
-      bucket* cur_bucket = cur_arena.buckets[jj];
-      while (cur_bucket != 0) {
-        int rv = pthread_mutex_lock(&cur_bucket->mutex);
-        assert(rv == 0);
-        if ((uint8_t*)ptr > (uint8_t*)cur_bucket && (uint8_t*)ptr < (uint8_t*)cur_bucket + PAGE_SIZE) {
-          rv = pthread_mutex_unlock(&cur_bucket->mutex);
-          assert(rv == 0);
-          return cur_bucket;
-        }
+  if (in_slab_space(ptr)) {
+    return (bucket*)((uintptr_t)ptr & ~(SLAB_SPAN - 1));
+  }
 
-        rv = pthread_mutex_unlock(&cur_bucket->mutex);
-        assert(rv == 0);
-        cur_bucket = cur_bucket->next_page;
+  uintptr_t entry = pagemap_get(ptr);
+  return entry & MAP_LARGE ? 0 : (bucket*)entry;
+}
+
+// Prepares a slab chain from an earlier run: locks held by that process
+// are reset, and the chain is cut at the first slab whose header never
+// reached the file (possible after a crash in checkpointed mode)
+static void reopen_chain(bucket* b, size_t block_size) {
+  while (b != 0) {
+    int rv = pthread_mutex_init(&b->mutex, NULL);
+    assert(rv == 0);
+    pagemap_set(b, SLAB_MIN << b->level, (uintptr_t)b);
+
+    bucket* next = b->next_page;
+    if (next != 0 && (!persist_contains(heap, next) || next->size != block_size
+                      || next->level >= SLAB_LEVELS)) {
+      b->next_page = 0;
+    }
+    b = b->next_page;
+  }
+}
+
+// Returns the pages of a slab with no blocks in use, past the first page
+// boundary of its data, to the kernel. They refault as zero pages, so the
+// blocks there count as never handed out again.
+static void trim_slab(bucket* b, int cls) {
+  int rv = pthread_mutex_lock(&b->mutex);
+  assert(rv == 0);
+
+  uint64_t* mapStart = (uint64_t*)(b + 1);
+  int maps = page_maps[cls][b->level];
+  int used = *(mapStart + maps - 1) != last_map[cls][b->level];
+  for (int ii = 0; !used && ii < maps - 1; ii++) {
+    used = *(mapStart + ii) != 0;
+  }
+
+  uint8_t* data = (uint8_t*)b + data_offset[cls];
+  uint8_t* start = (uint8_t*)(((uintptr_t)data + 4095) & ~(uintptr_t)4095);
+  uint32_t keep = (start - data + b->size - 1) / b->size;
+
+  if (!used && b->touched > keep) {
+    uint8_t* end = data + (size_t)b->touched * b->size;
+    end = (uint8_t*)(((uintptr_t)end + 4095) & ~(uintptr_t)4095);
+    if (end > (uint8_t*)b + (SLAB_MIN << b->level)) {
+      end = (uint8_t*)b + (SLAB_MIN << b->level);
+    }
+    madvise(start, end - start, MADV_DONTNEED);
+    b->touched = keep;
+  }
+
+  rv = pthread_mutex_unlock(&b->mutex);
+  assert(rv == 0);
+}
+
+// Called by the memory pressure monitor (pressure.h). Slabs stay in their
+// chains; blocks sitting in thread caches count as in use.
+static void par_trim() {
+  if (heap) {
+    // Pages of the heap file would only be read back in
+    return;
+  }
+
+  for (int ii = 0; ii < ARENAS; ii++) {
+    for (int cls = 0; cls < 8; cls++) {
+      bucket* b = __atomic_load_n(&arenas[ii].buckets[cls], __ATOMIC_ACQUIRE);
+      for (; b; b = __atomic_load_n(&b->next_page, __ATOMIC_ACQUIRE)) {
+        trim_slab(b, cls);
       }
     }
   }
+}
 
-  return 0;
+// The main thread's cache and deferred frees are never released by a
+// thread exit; blocks left there at the last checkpoint would stay in use
+// in the heap file for good
+static void close_heap() {
+  xmalloc_flush();
+  persist_checkpoint(heap);
 }
 
+// Runs once, via pthread_once. Slabs are not mapped here but on first use
+// of each size class in each arena, so starting up costs no system calls
+// beyond reading the NUMA topology.
 void init_arenas() {
-  int rv = pthread_mutex_lock(&init_mutex);
+  tune_init();
+  init_geometry();
+  numa_init();
+
+  int rv = pthread_key_create(&xcache_key, xcache_thread_exit);
   assert(rv == 0);
 
-  if (!arenas_init) {
-    for (int ii = 0; ii < 4; ii++) {
-      rv = pthread_mutex_init(&(arenas[ii].mutex), NULL);
-      assert(rv == 0);
-      size_t bucket_size = 16;
-      for (int jj = 0; jj < 8; jj++) {
-        arenas[ii].buckets[jj] = mmap(0, PAGE_SIZE, PROT_READ | PROT_WRITE,
-                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        assert(arenas[ii].buckets[jj] > 0);
-        init_page(bucket_size, arenas[ii].buckets[jj]);
-        bucket_size <<= 1;
+  int reopened = 0;
+  heap = persist_open(&reopened);
+  if (heap) {
+    arenas = heap->arenas;
+    atexit(close_heap);
+  } else {
+    // Reserve address space only; over-reserve by a span to align it
+    size_t bytes = ((size_t)ARENAS * 8 << REGION_SHIFT) + SLAB_SPAN;
+    void* space = mmap(0, bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (space != MAP_FAILED) {
+      slab_space = (uint8_t*)(((uintptr_t)space + SLAB_SPAN - 1) & ~(SLAB_SPAN - 1));
+    }
+  }
+
+  // With more nodes than arenas, some arenas serve several nodes; binding
+  // their slabs to any one of them would be wrong for the rest
+  for (int ii = 0; ii < ARENAS; ii++) {
+    int owners = 0;
+    for (int nn = 0; nn < numa_node_count(); nn++) {
+      if (ii >= node_first_arena(nn) && ii < node_end_arena(nn)) {
+        arenas[ii].node = nn;
+        owners++;
       }
     }
+    if (owners != 1) {
+      arenas[ii].node = -1;
+    }
+  }
 
-    arenas_init = 1;
+  for (int ii = 0; ii < ARENAS; ii++) {
+    int rv = pthread_mutex_init(&(arenas[ii].mutex), NULL);
+    assert(rv == 0);
+#ifdef PAR_PROFILE
+    memset(&arenas[ii].locks, 0, sizeof(arenas[ii].locks));
+    memset(arenas[ii].bucket_locks, 0, sizeof(arenas[ii].bucket_locks));
+#endif
+    size_t bucket_size = 16;
+    for (int jj = 0; jj < 8; jj++) {
+      if (reopened) {
+        reopen_chain(arenas[ii].buckets[jj], bucket_size);
+      } else {
+        arenas[ii].buckets[jj] = 0;
+        arenas[ii].slabs[jj] = 0;
+      }
+      arenas[ii].open[jj] = 0;
+      bucket_size <<= 1;
+    }
   }
 
-  rv = pthread_mutex_unlock(&init_mutex);
-  assert(rv == 0);
+#ifdef PAR_PROFILE
+  atexit(pprintstats);
+#endif
+
+  pressure_start(par_trim);
+  heapdump_start();
+}
+
+void* par_root() {
+  pthread_once(&arenas_once, init_arenas);
+
+  return heap ? heap->root : 0;
+}
+
+// Records the object the next run starts from. In checkpointed mode this
+// also makes it, and everything allocated so far, durable.
+void par_set_root(void* root) {
+  pthread_once(&arenas_once, init_arenas);
+
+  if (heap) {
+    heap->root = root;
+    if (heap->sync) {
+      persist_checkpoint(heap);
+    }
+  }
+}
+
+void par_checkpoint() {
+  if (heap) {
+    persist_checkpoint(heap);
+  }
 }
 
-// block size should be a power of 2 above 16
-void init_page(size_t block_size, void* start) {
+// Lays out each size class's slabs: header, bitmap and blocks, with the
+// bitmap and the blocks each starting on their own cache line. The data
+// offset fits the largest slab's bitmap; smaller slabs just have fewer
+// blocks, and the unused end of their bitmap is never touched.
+void init_geometry() {
+  for (int ii = 0; ii < 8; ii++) {
+    size_t block_size = (size_t)16 << ii;
+    size_t blocks = (SLAB_SPAN - sizeof(bucket)) / block_size;
+    size_t offset;
+
+    while (1) {
+      size_t maps = (blocks + 63) / 64;
+      offset = (sizeof(bucket) + maps * sizeof(uint64_t) + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+      if (offset + blocks * block_size <= SLAB_SPAN) {
+        break;
+      }
+      blocks--;
+    }
+
+    data_offset[ii] = offset;
+
+    for (int ll = 0; ll < SLAB_LEVELS; ll++) {
+      blocks = ((SLAB_MIN << ll) - offset) / block_size;
+      page_maps[ii][ll] = (blocks + 63) / 64;
+      last_map[ii][ll] = blocks % 64 ? ~0UL << (blocks % 64) : 0;
+    }
+  }
+}
+
+// start must be fresh (zeroed) memory, so only the last map needs setting
+void init_page(int cls, int level, void* start) {
   bucket* header = (bucket*)start;
-  header->size = block_size;
+  header->size = (size_t)16 << cls;
   header->next_page = 0;
+  header->touched = 0;
+  header->level = level;
+  header->hint = 0;
   int rv = pthread_mutex_init(&header->mutex, NULL);
   assert(rv == 0);
 
-  size_t bucketIdx = 0;
+  uint64_t* mapStart = (uint64_t*)(header + 1);
+  *(mapStart + page_maps[cls][level] - 1) = last_map[cls][level];
+}
 
-  while (block_size != 16) {
-    block_size >>= 1;
-    bucketIdx++;
-  }
+// Arenas are split evenly between NUMA nodes; each node gets at least one,
+// so with more nodes than arenas neighbouring nodes share. With a single
+// node, every arena belongs to node 0.
+int node_first_arena(int node) {
+  return node * ARENAS / numa_node_count();
+}
 
-  uint64_t* mapStart = (uint64_t*)(header + 1);
-  memset(mapStart, 0, (pageMaps[bucketIdx] - 1) * sizeof(uint64_t));
-  *(mapStart + pageMaps[bucketIdx] - 1) = lastMap[bucketIdx];
+int node_end_arena(int node) {
+  int end = (node + 1) * ARENAS / numa_node_count();
+  int first = node_first_arena(node);
+  return end > first ? end : first + 1;
 }
 
 void lock_arena() {
-  int rv = pthread_mutex_trylock(&(arenas[favorite_arena].mutex));
+  if (favorite_arena < 0) {
+    favorite_arena = node_first_arena(numa_current_node());
+  }
+
+  int rv = PROF_TRYLOCK(&(arenas[favorite_arena].mutex), &arenas[favorite_arena].locks);
   if (rv != 0) {
-    favorite_arena = (favorite_arena + 1) % 4;
-    rv = pthread_mutex_lock(&(arenas[favorite_arena].mutex));
+    PROF_HOP(&arenas[favorite_arena].locks);
+    tune_contended();
+
+    // Move to the next active arena on the node this thread is running on now
+    int node = numa_current_node();
+    int first = node_first_arena(node);
+    int end = node_end_arena(node);
+    if (end > first + tune_active_arenas()) {
+      end = first + tune_active_arenas();
+    }
+    favorite_arena = favorite_arena + 1;
+    if (favorite_arena < first || favorite_arena >= end) {
+      favorite_arena = first;
+    }
+    rv = PROF_LOCK(&(arenas[favorite_arena].mutex), &arenas[favorite_arena].locks);
     assert(rv == 0);
   }
 }
@@ -241,4 +856,156 @@ void lock_arena() {
 void unlock_arena() {
   int rv = pthread_mutex_unlock(&(arenas[favorite_arena].mutex));
   assert(rv == 0);
-}
\ No newline at end of file
+}
+
+void pprintstats() {
+  prof_dump(stderr);
+
+#ifdef PAR_PROFILE
+  char name[32];
+
+  fprintf(stderr, "\n== par malloc lock contention (cycles) ==\n");
+  fprintf(stderr, "%-10s %10s %9s %9s %7s %12s %8s %8s %8s\n", "lock", "acquires", "contended",
+          "tryfails", "hops", "wait", "avg", "p50", "p99");
+
+  for (int ii = 0; ii < ARENAS; ii++) {
+    snprintf(name, sizeof(name), "arena%d", ii);
+    prof_dump_lock(stderr, name, &arenas[ii].locks);
+
+    size_t bucket_size = 16;
+    for (int jj = 0; jj < 8; jj++) {
+      snprintf(name, sizeof(name), "  a%d/%zu", ii, bucket_size);
+      prof_dump_lock(stderr, name, &arenas[ii].bucket_locks[jj]);
+      bucket_size <<= 1;
+    }
+  }
+
+  tune_dump();
+#endif
+}
+
+// Longest run of free blocks in a slab's bitmap. Blocks past the end of
+// the slab are marked used in the last map, so they never count.
+static int largest_free_run(uint64_t* maps, int count) {
+  int best = 0;
+  int run = 0;
+
+  for (int ii = 0; ii < count; ii++) {
+    uint64_t word = *(maps + ii);
+    int pos = 0;
+
+    while (pos < 64) {
+      uint64_t rest = word >> pos;
+      if (rest & 1) {
+        best = run > best ? run : best;
+        run = 0;
+        pos += ~rest ? __builtin_ctzll(~rest) : 64;
+      } else {
+        int free = rest ? __builtin_ctzll(rest) : 64 - pos;
+        run += free;
+        pos += free;
+      }
+    }
+  }
+
+  return run > best ? run : best;
+}
+
+// One JSON object: every slab (arena, its NUMA node, class, blocks in use, blocks ever
+// handed out, longest free run), totals per class, large blocks, and a
+// summary. Internal fragmentation is slab space that holds no blocks
+// (headers, bitmaps, tails) plus large block page rounding; the rounding
+// of requests up to a class size isn't visible here (XMALLOC_TRACE has
+// the sizes). External fragmentation is the share of free blocks that
+// sit in slabs still in use, which can't be trimmed (see par_trim), per
+// class and weighted by free bytes overall. Blocks in thread caches and
+// deferred frees count as in use. Each slab is locked only while its
+// bitmap is read.
+void xmalloc_dump_heap(FILE* out) {
+  pthread_once(&arenas_once, init_arenas);
+
+  size_t slabs[8] = {0};
+  size_t used[8] = {0};
+  size_t unused[8] = {0};
+  size_t largest[8] = {0};
+  size_t stranded[8] = {0};
+  size_t slab_bytes = 0;
+  size_t overhead = 0;
+  const char* sep = "";
+
+  fprintf(out, "{\"backend\":\"par\",\"slabs\":[");
+
+  for (int ii = 0; ii < ARENAS; ii++) {
+    for (int cls = 0; cls < 8; cls++) {
+      bucket* b = __atomic_load_n(&arenas[ii].buckets[cls], __ATOMIC_ACQUIRE);
+      for (; b; b = __atomic_load_n(&b->next_page, __ATOMIC_ACQUIRE)) {
+        int rv = pthread_mutex_lock(&b->mutex);
+        assert(rv == 0);
+
+        uint64_t* mapStart = (uint64_t*)(b + 1);
+        int maps = page_maps[cls][b->level];
+        size_t bytes = SLAB_MIN << b->level;
+        size_t blocks = (bytes - data_offset[cls]) / b->size;
+        size_t in_use = -(size_t)__builtin_popcountll(last_map[cls][b->level]);
+        for (int jj = 0; jj < maps; jj++) {
+          in_use += __builtin_popcountll(*(mapStart + jj));
+        }
+        size_t run = largest_free_run(mapStart, maps);
+        uint32_t touched = b->touched;
+
+        rv = pthread_mutex_unlock(&b->mutex);
+        assert(rv == 0);
+
+        fprintf(out, "%s{\"arena\":%d,\"node\":%d,\"class\":%zu,\"bytes\":%zu,\"blocks\":%zu,"
+                "\"used\":%zu,\"touched\":%u,\"largest_free\":%zu}",
+                sep, ii, arenas[ii].node, b->size, bytes, blocks, in_use, touched, run);
+        sep = ",";
+
+        slabs[cls]++;
+        used[cls] += in_use;
+        unused[cls] += blocks - in_use;
+        largest[cls] = run > largest[cls] ? run : largest[cls];
+        stranded[cls] += in_use ? blocks - in_use : 0;
+        slab_bytes += bytes;
+        overhead += bytes - blocks * b->size;
+      }
+    }
+  }
+
+  fprintf(out, "],\"classes\":[");
+  sep = "";
+  size_t used_bytes = 0;
+  size_t free_bytes = 0;
+  double external = 0;
+
+  for (int cls = 0; cls < 8; cls++) {
+    if (slabs[cls] == 0) {
+      continue;
+    }
+
+    size_t size = (size_t)16 << cls;
+    double ext = unused[cls] ? (double)stranded[cls] / unused[cls] : 0;
+    fprintf(out, "%s{\"class\":%zu,\"slabs\":%zu,\"used\":%zu,\"free\":%zu,"
+            "\"largest_free\":%zu,\"external\":%.3f}",
+            sep, size, slabs[cls], used[cls], unused[cls], largest[cls], ext);
+    sep = ",";
+
+    used_bytes += used[cls] * size;
+    free_bytes += unused[cls] * size;
+    external += ext * unused[cls] * size;
+  }
+
+  long large = __atomic_load_n(&large_blocks, __ATOMIC_RELAXED);
+  size_t requested = __atomic_load_n(&large_requested, __ATOMIC_RELAXED);
+  size_t mapped = __atomic_load_n(&large_mapped, __ATOMIC_RELAXED);
+  size_t total = slab_bytes + mapped;
+
+  fprintf(out, "],\"large\":{\"blocks\":%ld,\"requested\":%zu,\"mapped\":%zu},", large,
+          requested, mapped);
+  fprintf(out, "\"summary\":{\"slab_bytes\":%zu,\"used_bytes\":%zu,\"free_bytes\":%zu,"
+          "\"overhead_bytes\":%zu,\"rss\":%zu,\"internal\":%.3f,\"external\":%.3f}}\n",
+          slab_bytes, used_bytes, free_bytes, overhead, heapdump_rss(),
+          total ? (double)(overhead + mapped - requested) / total : 0,
+          free_bytes ? external / free_bytes : 0);
+  fflush(out);
+}
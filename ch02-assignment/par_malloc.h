@@ -2,39 +2,87 @@
 #define PARMALLOC_H
 
 #include <pthread.h>
+#include <stdint.h>
+
+#include "par_prof.h"
 
 void* opt_malloc(size_t bytes);
+void* opt_calloc(size_t nmemb, size_t bytes);
 void opt_free(void* ptr);
 void* opt_realloc(void* prev, size_t bytes);
+void pprintstats();
+
+// Persistent heap (see par_persist.h); no-ops unless PAR_HEAP_FILE is set
+void* par_root();
+void par_set_root(void* root);
+void par_checkpoint();
+
+#define CACHE_LINE 64
+// Slabs start at SLAB_MIN bytes and double, per chain, up to
+// SLAB_MIN << (SLAB_LEVELS - 1) (1 MB)
+#define SLAB_MIN    ((size_t)64 * 1024)
+#define SLAB_LEVELS 5
+// Size classes smaller than a cache line (16 and 32 bytes)
+#define LINE_CLASSES 2
+
+// Slabs are carved from one PROT_NONE reservation, split into a region
+// per arena and size class, and each slab starts on its own SLAB_SPAN
+// boundary. A pointer's arena, class and slab are then address
+// arithmetic. Only the pages a slab uses are made accessible.
+#define SLAB_SPAN    (SLAB_MIN << (SLAB_LEVELS - 1))
+#define REGION_SHIFT 32
+#define REGION_SLABS ((1UL << REGION_SHIFT) / SLAB_SPAN)
+
+// Start of the slab reservation, or 0 when there is none
+extern uint8_t* slab_space;
+
+// Per-thread stacks of free blocks for the LINE_CLASSES, linked through
+// their first word. Filled by frees and by the rest of each cache line
+// claimed; xmalloc.h pops and pushes them inline (XMALLOC_PAR builds).
+// xcache_room is how many blocks a free may stack (PAR_CONFIG cache=, see
+// par_tune.h), 0 until the thread is set up and while tracing, so those
+// frees take the slow path.
+#define XCACHE_LIMIT 64
+extern __thread void* xcache_head[LINE_CLASSES];
+extern __thread int xcache_count[LINE_CLASSES];
+extern __thread int xcache_room;
+void* xmalloc_slow(size_t bytes);
+void xfree_slow(void* ptr);
 
+// Slab header. Padded to a full cache line so the mutex never shares a
+// line with the bitmap that follows it.
 typedef struct bucket {
   size_t size;
   struct bucket* next_page;
   pthread_mutex_t mutex;
-} bucket;
+  uint32_t touched;  // blocks from here on have never been handed out
+  uint16_t level;    // slab is SLAB_MIN << level bytes
+  uint16_t hint;     // maps before this one are known to be full
+} __attribute__((aligned(CACHE_LINE))) bucket;
 
+#define ARENAS 4
 
+// Aligned so neighbouring arenas' mutexes don't share a cache line
 typedef struct arena {
   pthread_mutex_t mutex;
+  int node;  // NUMA node its slabs are bound to, -1 for none
   bucket* buckets[8];
-} arena;
-
-// How many 64 bit maps are needed to represent the bucket in a page and what the last map should be
-const size_t pageMaps[8] = {993, 499, 250, 125, 63, 32, 16, 8};
-const size_t lastMap[8] = {~0UL << 12,
-                           ~0UL << 1,
-                           ~0UL << 31,
-                           ~0UL << 55,
-                           ~0UL << 29,
-                           ~0UL << 15,
-                           ~0UL << 39,
-                           ~0UL << 51};
+  bucket* open[8];    // slab to start each chain's search at, 0 for the head
+  uint32_t slabs[8];  // slabs carved from each class's region so far
+#ifdef PAR_PROFILE
+  lock_stats locks;
+  lock_stats bucket_locks[8];
+#endif
+} __attribute__((aligned(CACHE_LINE))) arena;
 
 void init_arenas();
+int node_first_arena(int node);
+int node_end_arena(int node);
 void lock_arena();
 void unlock_arena();
-void* first_free_block(bucket* b);
-void init_page(size_t block_size, void* start);
+void* first_free_block(arena* a, int blockIdx, int* run, int* fresh);
+void init_geometry();
+void init_page(int cls, int level, void* start);
 size_t get_block_size(void* ptr);
 bucket* closest_bucket(void* ptr);
 
@@ -0,0 +1,127 @@
+#define _GNU_SOURCE
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "par_numa.h"
+
+// Dense node index -> kernel node id, and cpu -> dense node index
+static int node_count = 1;
+static int node_ids[NUMA_MAX_NODES];
+static uint8_t cpu_node[NUMA_MAX_CPUS];
+
+// Parses a sysfs list like "0-3,8,10-11" into a flag per entry
+// Returns the number of entries set, or -1 if the file can't be read
+static int read_list(const char* path, uint8_t* flags, int max) {
+  char buf[4096];
+  FILE* fp = fopen(path, "r");
+  if (fp == 0) {
+    return -1;
+  }
+
+  size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+  fclose(fp);
+  buf[len] = 0;
+
+  int count = 0;
+  char* pp = buf;
+  while (*pp >= '0' && *pp <= '9') {
+    long lo = strtol(pp, &pp, 10);
+    long hi = lo;
+
+    if (*pp == '-') {
+      hi = strtol(pp + 1, &pp, 10);
+    }
+
+    for (long ii = lo; ii <= hi && ii < max; ii++) {
+      flags[ii] = 1;
+      count++;
+    }
+
+    if (*pp == ',') {
+      pp++;
+    }
+  }
+
+  return count;
+}
+
+void numa_init() {
+  const char* root = getenv("PAR_NUMA_SYSFS");
+  char path[512];
+  uint8_t online[NUMA_MAX_NODES];
+
+  if (root == 0) {
+    root = "/sys/devices/system/node";
+  }
+
+  memset(online, 0, sizeof(online));
+  snprintf(path, sizeof(path), "%s/online", root);
+  if (read_list(path, online, NUMA_MAX_NODES) <= 1) {
+    // Missing or single node: every cpu maps to node 0
+    node_count = 1;
+    node_ids[0] = 0;
+    return;
+  }
+
+  node_count = 0;
+  for (int nn = 0; nn < NUMA_MAX_NODES; nn++) {
+    if (!online[nn]) {
+      continue;
+    }
+
+    uint8_t cpus[NUMA_MAX_CPUS];
+    memset(cpus, 0, sizeof(cpus));
+    snprintf(path, sizeof(path), "%s/node%d/cpulist", root, nn);
+    read_list(path, cpus, NUMA_MAX_CPUS);
+
+    for (int cc = 0; cc < NUMA_MAX_CPUS; cc++) {
+      if (cpus[cc]) {
+        cpu_node[cc] = node_count;
+      }
+    }
+
+    node_ids[node_count] = nn;
+    node_count++;
+  }
+}
+
+int numa_node_count() {
+  return node_count;
+}
+
+// Returns the dense index of the node the calling thread is running on
+int numa_current_node() {
+  if (node_count == 1) {
+    return 0;
+  }
+
+  int cpu = sched_getcpu();
+  if (cpu < 0 || cpu >= NUMA_MAX_CPUS) {
+    return 0;
+  }
+
+  return cpu_node[cpu];
+}
+
+// Asks for fresh (untouched) memory to be placed on the given dense node,
+// or leaves it on first-touch policy for node -1. MPOL_PREFERRED is only a
+// placement hint: a full node spills to the others instead of failing the
+// fault, and a failed call leaves the memory on first touch too.
+void numa_bind(void* start, size_t length, int node) {
+  if (node_count == 1 || node < 0) {
+    return;
+  }
+
+  unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))];
+  memset(mask, 0, sizeof(mask));
+  int id = node_ids[node];
+  mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+
+  syscall(SYS_mbind, start, length, MPOL_PREFERRED, mask, NUMA_MAX_NODES + 1, 0);
+}
@@ -0,0 +1,18 @@
+#ifndef PARNUMA_H
+#define PARNUMA_H
+
+// NUMA topology for par_malloc, read from /sys/devices/system/node
+// (or from the directory named by PAR_NUMA_SYSFS, for testing).
+// On single-node machines nothing here makes a system call.
+
+#include <stddef.h>
+
+#define NUMA_MAX_NODES 64
+#define NUMA_MAX_CPUS  4096
+
+void numa_init();
+int numa_node_count();
+int numa_current_node();
+void numa_bind(void* start, size_t length, int node);
+
+#endif
@@ -0,0 +1,78 @@
+#include <assert.h>
+#include <sys/mman.h>
+
+#include "par_pagemap.h"
+
+typedef struct map_leaf {
+  uintptr_t entries[1 << MAP_LEAF_BITS];
+} map_leaf;
+
+typedef struct map_mid {
+  map_leaf* leaves[1 << MAP_MID_BITS];
+} map_mid;
+
+static map_mid* map_root[1 << MAP_ROOT_BITS];
+
+// Interior nodes are rare (one leaf covers 128 MB), so each gets its own
+// zeroed mapping
+static void* map_node(size_t bytes) {
+  void* node = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(node != MAP_FAILED);
+  return node;
+}
+
+// Installs a node unless another thread got there first
+static void* publish(void** slot, size_t bytes) {
+  void* node = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (node != 0) {
+    return node;
+  }
+
+  void* fresh = map_node(bytes);
+  if (__atomic_compare_exchange_n(slot, &node, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    return fresh;
+  }
+
+  munmap(fresh, bytes);
+  return node;
+}
+
+void pagemap_set(void* start, size_t bytes, uintptr_t entry) {
+  uintptr_t first = (uintptr_t)start >> PAGE_SHIFT;
+  uintptr_t last = ((uintptr_t)start + bytes - 1) >> PAGE_SHIFT;
+
+  for (uintptr_t page = first; page <= last; page++) {
+    uintptr_t ri = page >> (MAP_MID_BITS + MAP_LEAF_BITS);
+    uintptr_t mi = (page >> MAP_LEAF_BITS) & ((1 << MAP_MID_BITS) - 1);
+    uintptr_t li = page & ((1 << MAP_LEAF_BITS) - 1);
+    if (ri >= (1 << MAP_ROOT_BITS)) {
+      return;
+    }
+
+    map_mid* mid = publish((void**)&map_root[ri], sizeof(map_mid));
+    map_leaf* leaf = publish((void**)&mid->leaves[mi], sizeof(map_leaf));
+    __atomic_store_n(&leaf->entries[li], entry, __ATOMIC_RELEASE);
+  }
+}
+
+uintptr_t pagemap_get(void* ptr) {
+  uintptr_t page = (uintptr_t)ptr >> PAGE_SHIFT;
+  uintptr_t ri = page >> (MAP_MID_BITS + MAP_LEAF_BITS);
+
+  if (ri >= (1 << MAP_ROOT_BITS)) {
+    return 0;
+  }
+
+  map_mid* mid = __atomic_load_n(&map_root[ri], __ATOMIC_ACQUIRE);
+  if (mid == 0) {
+    return 0;
+  }
+
+  map_leaf* leaf = __atomic_load_n(&mid->leaves[(page >> MAP_LEAF_BITS) & ((1 << MAP_MID_BITS) - 1)],
+                                   __ATOMIC_ACQUIRE);
+  if (leaf == 0) {
+    return 0;
+  }
+
+  return __atomic_load_n(&leaf->entries[page & ((1 << MAP_LEAF_BITS) - 1)], __ATOMIC_ACQUIRE);
+}
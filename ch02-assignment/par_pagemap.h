@@ -0,0 +1,33 @@
+#ifndef PARPAGEMAP_H
+#define PARPAGEMAP_H
+
+// Page map for par_malloc: a three level radix tree keyed by the page
+// number of an address, giving the slab or large block that owns it.
+//
+// Lookups take no locks: one load per level, and a missing level means
+// the page isn't owned. Interior nodes are mapped on first use, published
+// with a compare and swap, and never freed.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PAGE_SHIFT 12
+// 57 bit user addresses (five level paging): 45 bits of page number,
+// split 15 / 15 / 15. Nodes are zeroed mappings, so only the parts of a
+// node that are used take memory.
+#define MAP_ROOT_BITS 15
+#define MAP_MID_BITS  15
+#define MAP_LEAF_BITS 15
+
+// Entries are slab headers (bucket*), or large block mappings tagged with
+// MAP_LARGE. Both are at least 8 byte aligned, so the low bit is free.
+#define MAP_LARGE ((uintptr_t)1)
+
+// Sets the entry for every page in [start, start + bytes); pages past
+// the map (no user address is) are skipped
+void pagemap_set(void* start, size_t bytes, uintptr_t entry);
+// Returns the entry for the page holding ptr, or 0, also for any address
+// past the map
+uintptr_t pagemap_get(void* ptr);
+
+#endif
@@ -0,0 +1,199 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "par_persist.h"
+
+// A free extent of the file, stored at its own start. Everything after
+// this header is zero (punched out, or cleared when the extent was freed).
+typedef struct free_extent {
+  uint64_t size;
+  uint64_t next;  // offset of the next extent, 0 at the end
+} free_extent;
+
+static pthread_mutex_t free_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t round_page(size_t bytes) {
+  return (bytes + 4095) & ~(size_t)4095;
+}
+
+static uint64_t env_number(const char* name, uint64_t fallback) {
+  const char* value = getenv(name);
+  return value ? strtoull(value, 0, 0) : fallback;
+}
+
+superblock* persist_open(int* reopened) {
+  const char* path = getenv("PAR_HEAP_FILE");
+  *reopened = 0;
+
+  if (path == 0) {
+    return 0;
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  assert(fd >= 0);
+
+  // A previous heap decides where and how big the mapping is
+  superblock old;
+  memset(&old, 0, sizeof(old));
+  ssize_t got = pread(fd, &old, sizeof(old), 0);
+  int usable = got == sizeof(old) && old.magic == HEAP_MAGIC && old.durable;
+
+  if (usable && old.layout != HEAP_LAYOUT) {
+    // Its arenas would be misread; starting over would lose the data
+    fprintf(stderr, "par_malloc: %s was written by a build with a different heap layout\n", path);
+    exit(1);
+  }
+
+  uint64_t base = usable ? old.base : env_number("PAR_HEAP_BASE", HEAP_DEFAULT_BASE);
+  uint64_t size = usable ? old.size : env_number("PAR_HEAP_SIZE", HEAP_DEFAULT_SIZE);
+
+  if (got > 0 && !usable) {
+    fprintf(stderr, "par_malloc: %s was not closed cleanly, starting a new heap\n", path);
+  }
+
+  if (!usable) {
+    // Start over with an empty (sparse) file
+    int rv = ftruncate(fd, 0);
+    assert(rv == 0);
+  }
+
+  int rv = ftruncate(fd, size);
+  assert(rv == 0);
+
+  superblock* sb = mmap((void*)base, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+  close(fd);
+  assert(sb != MAP_FAILED);
+  // Pointers in the heap are absolute, so the file can't move
+  assert((uint64_t)sb == base);
+
+  if (usable) {
+    *reopened = 1;
+  } else {
+    sb->magic = HEAP_MAGIC;
+    sb->layout = HEAP_LAYOUT;
+    sb->free = 0;
+    sb->base = base;
+    sb->size = size;
+    sb->used = round_page(sizeof(superblock));
+    sb->root = 0;
+  }
+
+  sb->sync = env_number("PAR_HEAP_SYNC", 0);
+  // Until the next clean close or checkpoint, a crash leaves it untrusted
+  sb->durable = sb->sync && usable;
+  msync(sb, sizeof(superblock), MS_SYNC);
+
+  return sb;
+}
+
+// Takes the end of the first free extent big enough, or all of it
+static void* take_free(superblock* sb, size_t bytes) {
+  uint64_t* link = &sb->free;
+
+  while (*link != 0) {
+    free_extent* ext = (free_extent*)((char*)sb + *link);
+
+    if (ext->size > bytes) {
+      ext->size -= bytes;
+      return (char*)ext + ext->size;
+    }
+
+    if (ext->size == bytes) {
+      *link = ext->next;
+      memset(ext, 0, sizeof(free_extent));
+      return ext;
+    }
+
+    link = &ext->next;
+  }
+
+  return 0;
+}
+
+void* persist_alloc(superblock* sb, size_t bytes) {
+  bytes = round_page(bytes);
+
+  if (__atomic_load_n(&sb->free, __ATOMIC_RELAXED) != 0) {
+    pthread_mutex_lock(&free_mutex);
+    void* space = take_free(sb, bytes);
+    pthread_mutex_unlock(&free_mutex);
+    if (space) {
+      return space;
+    }
+  }
+
+  uint64_t offset = __atomic_fetch_add(&sb->used, bytes, __ATOMIC_RELAXED);
+  // Out of reserved space; PAR_HEAP_SIZE sets the reservation
+  assert(offset + bytes <= sb->size);
+  return (char*)sb + offset;
+}
+
+// Zeroes an extent but for its header, and gives its pages back to the
+// file system where it can punch holes
+static void clear_extent(free_extent* ext, size_t bytes) {
+  memset(ext + 1, 0, 4096 - sizeof(free_extent));
+  if (bytes > 4096 && madvise((char*)ext + 4096, bytes - 4096, MADV_REMOVE) != 0) {
+    memset((char*)ext + 4096, 0, bytes - 4096);
+  }
+}
+
+void persist_free(superblock* sb, void* start, size_t bytes) {
+  bytes = round_page(bytes);
+  uint64_t offset = (char*)start - (char*)sb;
+  free_extent* ext = start;
+
+  clear_extent(ext, bytes);
+  ext->size = bytes;
+
+  pthread_mutex_lock(&free_mutex);
+
+  uint64_t* link = &sb->free;
+  free_extent* prev = 0;
+  while (*link != 0 && *link < offset) {
+    prev = (free_extent*)((char*)sb + *link);
+    link = &prev->next;
+  }
+
+  ext->next = *link;
+  *link = offset;
+
+  // Merge with the following extent, then into the preceding one
+  if (ext->next == offset + ext->size) {
+    free_extent* next = (free_extent*)((char*)sb + ext->next);
+    ext->size += next->size;
+    ext->next = next->next;
+    memset(next, 0, sizeof(free_extent));
+  }
+  if (prev && (char*)prev + prev->size == (char*)ext) {
+    prev->size += ext->size;
+    prev->next = ext->next;
+    memset(ext, 0, sizeof(free_extent));
+  }
+
+  pthread_mutex_unlock(&free_mutex);
+}
+
+int persist_contains(superblock* sb, void* ptr) {
+  return sb != 0 && (char*)ptr >= (char*)sb && (char*)ptr < (char*)sb + sb->size;
+}
+
+// Flushes every allocated byte, then the superblock that vouches for them
+void persist_checkpoint(superblock* sb) {
+  uint64_t used = __atomic_load_n(&sb->used, __ATOMIC_RELAXED);
+  size_t header = round_page(sizeof(superblock));
+
+  int rv = msync((char*)sb + header, used - header, MS_SYNC);
+  assert(rv == 0);
+
+  sb->durable = 1;
+  rv = msync(sb, header, MS_SYNC);
+  assert(rv == 0);
+}
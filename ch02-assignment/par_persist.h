@@ -0,0 +1,60 @@
+#ifndef PARPERSIST_H
+#define PARPERSIST_H
+
+// Persistent, file-backed heap for par_malloc.
+//
+// When PAR_HEAP_FILE names a file, every slab and large block is carved
+// out of that file, mapped shared at a fixed base address (PAR_HEAP_BASE,
+// default below) so pointers stored in the heap stay valid across runs.
+// The superblock at the start of the file holds the arenas and one root
+// pointer, from which the application finds its data again.
+//
+// A heap is trusted on the next start only if it was closed cleanly (at
+// exit) or, with PAR_HEAP_SYNC=1, if it was checkpointed: par_checkpoint()
+// msyncs the heap and then the superblock, so after a crash the root and
+// everything allocated before the last checkpoint are on disk. Objects
+// changed in place after the checkpoint may or may not be.
+//
+// Slabs stay in the file for good. Freed large blocks, including ones left
+// by an earlier run, go on an address ordered list of free extents that
+// later slabs and large blocks are carved from; their pages are punched out
+// of the file. PAR_HEAP_SIZE bounds the file: an allocation that fits in
+// neither a free extent nor the unused tail fails an assertion.
+//
+// A file is only reopened by a build with the same arena layout (ARENAS,
+// PAR_PROFILE and so on change it), checked through the layout field.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "par_malloc.h"
+
+#define HEAP_MAGIC        0x7061726865617035UL  // "parheap5"
+#define HEAP_LAYOUT       ((uint64_t)sizeof(superblock) << 32 | sizeof(arena) << 16 | sizeof(bucket))
+#define HEAP_DEFAULT_BASE 0x600000000000UL
+#define HEAP_DEFAULT_SIZE (1UL << 30)
+
+typedef struct superblock {
+  uint64_t magic;
+  uint64_t layout;   // HEAP_LAYOUT of the build that made it
+  uint64_t base;     // address the file is mapped at
+  uint64_t size;     // bytes of address space reserved for the heap
+  uint64_t used;     // offset of the next unused byte
+  uint64_t durable;  // 1 if the file can be trusted on the next start
+  uint64_t sync;     // 1 in crash-consistency (checkpointed) mode
+  uint64_t free;     // offset of the first free extent, 0 if none
+  void* root;
+  arena arenas[ARENAS];
+} superblock;
+
+// Maps the heap file if PAR_HEAP_FILE is set. Returns 0 if it isn't.
+// *reopened is set if the file held a usable heap from an earlier run.
+superblock* persist_open(int* reopened);
+// Carves page aligned, zeroed memory out of the heap file
+void* persist_alloc(superblock* sb, size_t bytes);
+// Returns page aligned space from persist_alloc to the file
+void persist_free(superblock* sb, void* start, size_t bytes);
+int persist_contains(superblock* sb, void* ptr);
+void persist_checkpoint(superblock* sb);
+
+#endif
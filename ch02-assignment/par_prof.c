@@ -0,0 +1,200 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "par_prof.h"
+
+// Per thread latency histograms. These are mapped directly rather than
+// allocated through opt_malloc so the profiler never profiles itself, and
+// they outlive their thread so they can still be dumped at exit.
+typedef struct prof_thread {
+  uint64_t lat[PROF_CLASSES][PATH_COUNT][PROF_BUCKETS];
+  struct prof_thread* next;
+} prof_thread;
+
+#ifdef PAR_PROFILE
+
+static prof_thread* all_threads = 0;
+static const char* path_names[PATH_COUNT] = {"fast", "scan", "slab", "mmap", "free"};
+static const char* class_names[PROF_CLASSES] = {"16", "32", "64", "128", "256",
+                                                "512", "1024", "2048", "large", "any"};
+
+__thread int prof_path = PATH_FAST;
+static __thread prof_thread* my_thread = 0;
+
+static prof_thread* prof_thread_init() {
+  prof_thread* pt = mmap(0, sizeof(prof_thread), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(pt != MAP_FAILED);
+
+  pt->next = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE);
+  while (!__atomic_compare_exchange_n(&all_threads, &pt->next, pt, 0,
+                                      __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+  }
+
+  my_thread = pt;
+  return pt;
+}
+
+void prof_record(int size_class, int path, uint64_t cycles) {
+  prof_thread* pt = my_thread ? my_thread : prof_thread_init();
+  int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+
+  if (bucket >= PROF_BUCKETS) {
+    bucket = PROF_BUCKETS - 1;
+  }
+
+  // Only this thread writes its histogram; readers tolerate torn counts
+  pt->lat[size_class][path][bucket]++;
+}
+
+static void add_wait(lock_stats* ls, uint64_t cycles) {
+  static __thread unsigned sample = 0;
+
+  __atomic_fetch_add(&ls->contended, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&ls->wait_cycles, cycles, __ATOMIC_RELAXED);
+
+  if (sample++ % PROF_LOCK_SAMPLE == 0) {
+    int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+    if (bucket >= PROF_BUCKETS) {
+      bucket = PROF_BUCKETS - 1;
+    }
+    __atomic_fetch_add(&ls->waits[bucket], 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Locks the mutex, timing the wait only when the lock is already held
+int prof_lock(pthread_mutex_t* mutex, lock_stats* ls) {
+  int rv = pthread_mutex_trylock(mutex);
+
+  if (rv != 0) {
+    uint64_t t0 = prof_now();
+    rv = pthread_mutex_lock(mutex);
+    add_wait(ls, prof_now() - t0);
+  }
+
+  if (rv == 0) {
+    __atomic_fetch_add(&ls->acquires, 1, __ATOMIC_RELAXED);
+  }
+
+  return rv;
+}
+
+int prof_trylock(pthread_mutex_t* mutex, lock_stats* ls) {
+  int rv = pthread_mutex_trylock(mutex);
+
+  if (rv == 0) {
+    __atomic_fetch_add(&ls->acquires, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_fetch_add(&ls->trylock_fails, 1, __ATOMIC_RELAXED);
+  }
+
+  return rv;
+}
+
+void prof_hop(lock_stats* ls) {
+  __atomic_fetch_add(&ls->hops, 1, __ATOMIC_RELAXED);
+}
+
+// Returns the upper bound (in cycles) of the bucket holding the given quantile
+static uint64_t quantile(uint64_t* hist, uint64_t total, double q) {
+  uint64_t seen = 0;
+  uint64_t target = (uint64_t)(total * q);
+
+  for (int ii = 0; ii < PROF_BUCKETS; ii++) {
+    seen += hist[ii];
+    if (seen > target) {
+      return 2UL << ii;
+    }
+  }
+
+  return 2UL << (PROF_BUCKETS - 1);
+}
+
+void prof_dump(FILE* out) {
+  static uint64_t merged[PROF_CLASSES][PATH_COUNT][PROF_BUCKETS];
+  int threads = 0;
+
+  memset(merged, 0, sizeof(merged));
+
+  for (prof_thread* pt = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE); pt != 0; pt = pt->next) {
+    threads++;
+    for (int cc = 0; cc < PROF_CLASSES; cc++) {
+      for (int pp = 0; pp < PATH_COUNT; pp++) {
+        for (int bb = 0; bb < PROF_BUCKETS; bb++) {
+          merged[cc][pp][bb] += pt->lat[cc][pp][bb];
+        }
+      }
+    }
+  }
+
+  fprintf(out, "\n== par malloc latency (cycles, %d threads) ==\n", threads);
+  fprintf(out, "%-6s %-5s %10s %8s %8s %8s %8s\n", "class", "path", "count", "p50", "p99", "p99.9", "max");
+
+  for (int cc = 0; cc < PROF_CLASSES; cc++) {
+    for (int pp = 0; pp < PATH_COUNT; pp++) {
+      uint64_t* hist = merged[cc][pp];
+      uint64_t total = 0;
+      int top = 0;
+
+      for (int bb = 0; bb < PROF_BUCKETS; bb++) {
+        total += hist[bb];
+        if (hist[bb]) {
+          top = bb;
+        }
+      }
+
+      if (total == 0) {
+        continue;
+      }
+
+      fprintf(out, "%-6s %-5s %10lu %8lu %8lu %8lu %8lu\n", class_names[cc], path_names[pp], total,
+              quantile(hist, total, 0.5), quantile(hist, total, 0.99),
+              quantile(hist, total, 0.999), 2UL << top);
+
+      // Raw histogram as "log2 bucket:count" pairs
+      fprintf(out, "      ");
+      for (int bb = 0; bb <= top; bb++) {
+        if (hist[bb]) {
+          fprintf(out, " %d:%lu", bb, hist[bb]);
+        }
+      }
+      fprintf(out, "\n");
+    }
+  }
+}
+
+void prof_dump_lock(FILE* out, const char* name, lock_stats* ls) {
+  uint64_t sampled = 0;
+
+  if (ls->acquires == 0 && ls->trylock_fails == 0) {
+    return;
+  }
+
+  for (int bb = 0; bb < PROF_BUCKETS; bb++) {
+    sampled += ls->waits[bb];
+  }
+
+  fprintf(out, "%-10s %10lu %9lu %9lu %7lu %12lu %8lu", name, ls->acquires, ls->contended,
+          ls->trylock_fails, ls->hops, ls->wait_cycles,
+          ls->contended ? ls->wait_cycles / ls->contended : 0);
+
+  if (sampled) {
+    fprintf(out, " %8lu %8lu", quantile(ls->waits, sampled, 0.5), quantile(ls->waits, sampled, 0.99));
+  }
+
+  fprintf(out, "\n");
+}
+
+#else
+
+void prof_dump(FILE* out) {
+  fprintf(out, "\n== par malloc latency: built without PAR_PROFILE ==\n");
+}
+
+void prof_dump_lock(FILE* out, const char* name, lock_stats* ls) {
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef PARPROF_H
+#define PARPROF_H
+
+// Optional allocator instrumentation for par_malloc.
+// Build with PROFILE=1 (-DPAR_PROFILE) to enable; otherwise every macro
+// below compiles away to nothing.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Paths an allocator call can take, from cheapest to most expensive
+enum prof_path {
+  PATH_FAST,   // bitmap hit in the arena's first slab
+  PATH_SCAN,   // had to walk the next_page chain to find a free block
+  PATH_SLAB,   // mapped and initialized a new slab
+  PATH_MMAP,   // large allocation served directly by mmap
+  PATH_FREE,   // opt_free
+  PATH_COUNT
+};
+
+// 8 bucket size classes (16 .. 2048 bytes), one class for large blocks and
+// one for calls whose size is not known up front (frees)
+#define PROF_CLASSES 10
+#define PROF_LARGE   8
+#define PROF_ANY     9
+// Latency histograms are bucketed by floor(log2(cycles))
+#define PROF_BUCKETS 40
+// Only one in this many contended waits is added to a wait histogram
+#define PROF_LOCK_SAMPLE 8
+
+// Contention counters for one allocator mutex (an arena, or one size class
+// of an arena). Updated with relaxed atomics by every thread.
+typedef struct lock_stats {
+  uint64_t acquires;       // successful acquisitions
+  uint64_t contended;      // acquisitions that had to block
+  uint64_t trylock_fails;  // failed trylocks (lock_arena only)
+  uint64_t hops;           // times a thread gave up on this arena for another
+  uint64_t wait_cycles;    // total time spent blocked
+  uint64_t waits[PROF_BUCKETS];  // sampled log2 histogram of blocked time
+} lock_stats;
+
+#ifdef PAR_PROFILE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t prof_now() { return __rdtsc(); }
+#else
+#include <time.h>
+static inline uint64_t prof_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+#endif
+
+extern __thread int prof_path;
+
+void prof_record(int size_class, int path, uint64_t cycles);
+
+int prof_lock(pthread_mutex_t* mutex, lock_stats* ls);
+int prof_trylock(pthread_mutex_t* mutex, lock_stats* ls);
+void prof_hop(lock_stats* ls);
+
+#define PROF_START()        uint64_t prof_t0 = prof_now(); prof_path = PATH_FAST
+#define PROF_PATH(pp)       (prof_path = (pp))
+#define PROF_END(cls)       prof_record((cls), prof_path, prof_now() - prof_t0)
+#define PROF_LOCK(mm, ls)   prof_lock((mm), (ls))
+#define PROF_TRYLOCK(mm, ls) prof_trylock((mm), (ls))
+#define PROF_HOP(ls)        prof_hop(ls)
+
+#else
+
+#define PROF_START()
+#define PROF_PATH(pp)
+#define PROF_END(cls)
+#define PROF_LOCK(mm, ls)   pthread_mutex_lock(mm)
+#define PROF_TRYLOCK(mm, ls) pthread_mutex_trylock(mm)
+#define PROF_HOP(ls)
+
+#endif
+
+// Writes the histograms of every thread, merged, to the given stream
+void prof_dump(FILE* out);
+// Writes one line of contention counters (if the lock was ever used)
+void prof_dump_lock(FILE* out, const char* name, lock_stats* ls);
+
+#endif
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "par_malloc.h"
+#include "par_tune.h"
+#include "pressure.h"
+
+tune_config tune = {ARENAS, XCACHE_LIMIT, 0, 0, (size_t)1 << 30};
+
+static int active_arenas = ARENAS;
+static long contended = 0;
+static size_t slab_bytes = 0;
+
+static size_t parse_bytes(const char* value, char** end) {
+  size_t bytes = strtoull(value, end, 0);
+  switch (**end) {
+  case 'G': case 'g':
+    bytes <<= 10;
+    // fall through
+  case 'M': case 'm':
+    bytes <<= 10;
+    // fall through
+  case 'K': case 'k':
+    bytes <<= 10;
+    (*end)++;
+  }
+  return bytes;
+}
+
+static int clamp(long value, int lo, int hi) {
+  return value < lo ? lo : value > hi ? hi : value;
+}
+
+void tune_init() {
+  const char* conf = getenv("PAR_CONFIG");
+
+  while (conf && *conf) {
+    size_t len = strcspn(conf, "=,");
+    const char* value = conf + len + (conf[len] == '=');
+    char* end = (char*)value;
+
+    if (len == 6 && strncmp(conf, "arenas", len) == 0) {
+      tune.arenas = clamp(strtol(value, &end, 0), 1, ARENAS);
+    } else if (len == 5 && strncmp(conf, "cache", len) == 0) {
+      tune.cache = clamp(strtol(value, &end, 0), 0, TUNE_CACHE_MAX);
+    } else if (len == 4 && strncmp(conf, "slab", len) == 0) {
+      size_t bytes = parse_bytes(value, &end);
+      tune.slab_level = 0;
+      while (tune.slab_level + 1 < SLAB_LEVELS && (SLAB_MIN << tune.slab_level) < bytes) {
+        tune.slab_level++;
+      }
+    } else if (len == 5 && strncmp(conf, "adapt", len) == 0) {
+      tune.adapt = strtol(value, &end, 0) != 0;
+    } else if (len == 5 && strncmp(conf, "limit", len) == 0) {
+      tune.limit = parse_bytes(value, &end);
+    } else {
+      fprintf(stderr, "par_malloc: unknown PAR_CONFIG setting '%.*s'\n", (int)len, conf);
+    }
+
+    conf = end + strcspn(end, ",");
+    conf += *conf == ',';
+  }
+
+  active_arenas = tune.adapt ? 1 : tune.arenas;
+}
+
+int tune_active_arenas() {
+  return __atomic_load_n(&active_arenas, __ATOMIC_RELAXED);
+}
+
+void tune_contended() {
+  long count = __atomic_add_fetch(&contended, 1, __ATOMIC_RELAXED);
+  if (!tune.adapt) {
+    return;
+  }
+
+  int active = tune_active_arenas();
+  if (count % TUNE_CONTENDED == 0 && active < tune.arenas
+      && __atomic_load_n(&slab_bytes, __ATOMIC_RELAXED) < tune.limit / 2) {
+    __atomic_compare_exchange_n(&active_arenas, &active, active + 1, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  }
+}
+
+void tune_slab_mapped(size_t bytes) {
+  __atomic_add_fetch(&slab_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+// Memory pressure (pressure.h) counts whether or not adapt mode is on
+static int over_limit() {
+  return pressure_active()
+    || (tune.adapt && __atomic_load_n(&slab_bytes, __ATOMIC_RELAXED) > tune.limit / 4 * 3);
+}
+
+int tune_next_level(int level) {
+  // A smaller slab in the reservation still takes a whole SLAB_SPAN slot,
+  // but only its own size is made accessible and counted; a class whose
+  // region fills up goes on with slabs mapped one at a time (new_slab)
+  if (over_limit()) {
+    return tune.slab_level;
+  }
+  return level + 1 < SLAB_LEVELS ? level + 1 : level;
+}
+
+int tune_cache_room(int room, int spills) {
+  if (over_limit()) {
+    return room > 8 ? room / 2 : room;
+  }
+
+  if (!tune.adapt) {
+    return room;
+  }
+
+  // Overflowing on more than one event in eight: the thread frees in
+  // bursts bigger than its cache
+  int max = tune.cache * 16 < TUNE_CACHE_MAX ? tune.cache * 16 : TUNE_CACHE_MAX;
+  if (spills * 8 > TUNE_PERIOD && room < max) {
+    return room * 2 < max ? room * 2 : max;
+  }
+  return room;
+}
+
+void tune_dump() {
+  fprintf(stderr, "\n== par malloc tuning ==\n");
+  fprintf(stderr, "active arenas %d of %d, slab memory %zu kB, contended trylocks %ld\n",
+          tune_active_arenas(), tune.arenas, slab_bytes >> 10, contended);
+}
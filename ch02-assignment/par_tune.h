@@ -0,0 +1,53 @@
+#ifndef PARTUNE_H
+#define PARTUNE_H
+
+// Runtime parameters for par_malloc, read once from PAR_CONFIG, a comma
+// separated list of name=value pairs, e.g. PAR_CONFIG=arenas=2,adapt=1:
+//
+//   arenas=N     arenas each node's threads spread over, 1 to ARENAS
+//   cache=N      blocks a thread caches per line class (default 64)
+//   slab=BYTES   size of each class's first slab, SLAB_MIN up to SLAB_SPAN
+//   adapt=1      adjust the above while running, see below
+//   limit=BYTES  slab memory adapt mode tries to stay under (default 1G)
+//
+// BYTES may end in K, M or G. Unknown names are reported and skipped.
+//
+// In adapt mode, threads start on one arena per node. Each run of failed
+// arena trylocks opens another arena, up to arenas=. A thread cache that
+// keeps overflowing doubles, up to 16 times cache=. Slab chains keep
+// doubling their slabs. Past half the limit, no more arenas open. Past
+// three quarters, caches shrink and new slabs drop back to the first size.
+// Memory pressure (pressure.h) does the same, in adapt mode or not.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TUNE_CACHE_MAX 4096
+// Slow-path cache events (misses and overflows) between cache resizes
+#define TUNE_PERIOD    1024
+// Failed arena trylocks that open another arena
+#define TUNE_CONTENDED 64
+
+typedef struct tune_config {
+  int arenas;
+  int cache;
+  int slab_level;  // first slabs are SLAB_MIN << slab_level bytes
+  int adapt;
+  size_t limit;
+} tune_config;
+
+extern tune_config tune;
+
+void tune_init();
+// Arenas each node's threads currently spread over
+int tune_active_arenas();
+// Counts a failed arena trylock; in adapt mode, may open another arena
+void tune_contended();
+// Counts slab memory mapped, and picks the level of the next slab in a chain
+void tune_slab_mapped(size_t bytes);
+int tune_next_level(int level);
+// New per-thread cache size after a period with this many overflows
+int tune_cache_room(int room, int spills);
+void tune_dump();
+
+#endif
@@ -0,0 +1,117 @@
+// The Collatz conjecture, with results kept in a persistent heap.
+
+// Run with PAR_HEAP_FILE=path (see par_persist.h). The first run computes
+// the step count of every start value below TOP into one large block,
+// keeps it and the longest sequence (as a list) under the heap's root,
+// and exits. Later runs with the same TOP find the root again and check
+// everything stored against a fresh computation, which replaces the old
+// array and list: each run frees a large block, whose file space the next
+// one reuses, and a list of small blocks. Without PAR_HEAP_FILE every run
+// starts from scratch.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+#include "par_malloc.h"
+#include "list.h"
+
+typedef struct results {
+    long      top;
+    long      max_v;
+    long      max_s;
+    uint16_t* steps;
+    cell*     path;  // sequence from max_v, ending at its head with 1
+} results;
+
+long
+collatz_step(long n)
+{
+    if (n % 2 == 0) {
+        return n/2;
+    }
+    else {
+        return 3*n + 1;
+    }
+}
+
+uint16_t*
+compute_steps(long top)
+{
+    uint16_t* steps = xmalloc(top * sizeof(uint16_t));
+    steps[0] = 0;
+
+    for (long ii = 1; ii < top; ++ii) {
+        long vv = ii;
+        long ss = 0;
+        while (vv >= ii && vv > 1) {
+            vv = collatz_step(vv);
+            ss++;
+        }
+        steps[ii] = ss + (vv < ii ? steps[vv] : 0);
+    }
+
+    return steps;
+}
+
+cell*
+sequence(long vv)
+{
+    cell* xs = cons(vv, 0);
+    while (vv > 1) {
+        vv = collatz_step(vv);
+        xs = cons(vv, xs);
+    }
+    return xs;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        printf("Usage:\n");
+        printf("\t%s TOP\n", argv[0]);
+        return 1;
+    }
+
+    long top = atol(argv[1]);
+    assert(top > 1);
+
+    uint16_t* steps = compute_steps(top);
+    results* rr = par_root();
+
+    if (rr && rr->top == top) {
+        for (long ii = 0; ii < top; ++ii) {
+            assert(rr->steps[ii] == steps[ii]);
+        }
+        assert(rr->steps[rr->max_v] == rr->max_s);
+        assert(count_list(rr->path) == rr->max_s + 1 && rr->path->item == 1);
+
+        xfree(rr->steps);
+        rr->steps = steps;
+        free_list(rr->path);
+        rr->path = sequence(rr->max_v);
+        printf("Resumed from the heap\n");
+    }
+    else {
+        rr = xmalloc(sizeof(results));
+        rr->top = top;
+        rr->steps = steps;
+        rr->max_v = 0;
+        rr->max_s = 0;
+        for (long ii = 0; ii < top; ++ii) {
+            if (steps[ii] > rr->max_s) {
+                rr->max_v = ii;
+                rr->max_s = steps[ii];
+            }
+        }
+        rr->path = sequence(rr->max_v);
+    }
+
+    par_set_root(rr);
+    printf("Max steps is at %ld: %ld steps\n", rr->max_v, rr->max_s);
+
+    return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef PLIST_H
+#define PLIST_H
+
+// Persistent linked list: cells are immutable once built and shared
+// between lists, with a reference count deciding when they are freed.
+//
+// Every cell* a caller holds owns one reference. pcons() takes over the
+// reference to rest, pshare() is the O(1) copy, and prelease() frees
+// cells only until it reaches one that another list still shares.
+
+#include "xmalloc.h"
+
+typedef struct pcell {
+    long          item;
+    long          refs;
+    struct pcell* rest;
+} pcell;
+
+static
+pcell*
+pcons(long item, pcell* rest)
+{
+    pcell* xs = xmalloc(sizeof(pcell));
+    xs->item = item;
+    xs->refs = 1;
+    xs->rest = rest;
+    return xs;
+}
+
+static
+pcell*
+pshare(pcell* xs)
+{
+    if (xs) {
+        __atomic_add_fetch(&xs->refs, 1, __ATOMIC_RELAXED);
+    }
+    return xs;
+}
+
+static
+long
+pcount_list(pcell* xs)
+{
+    long nn = 0;
+    while (xs) {
+        nn++;
+        xs = xs->rest;
+    }
+    return nn;
+}
+
+// Iterative, so long lists can't overflow the stack
+static
+void
+prelease(pcell* xs)
+{
+    while (xs && __atomic_sub_fetch(&xs->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pcell* ys = xs->rest;
+        xfree(xs);
+        xs = ys;
+    }
+}
+
+#endif
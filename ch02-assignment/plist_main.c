@@ -0,0 +1,158 @@
+// The Collatz conjecture, with persistent (shared) lists.
+
+// Same search and scheduling as list_main.c, but each 50-step extension
+// no longer deep-copies the task's sequence before prepending to it: the
+// new cells share the old list as their tail (see plist.h), so a step
+// costs only the cells it adds, and dropping the old head frees nothing
+// that is still in use.
+
+#include <stdio.h>
+#include <pthread.h>
+#include <assert.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+#include "plist.h"
+
+#define THREADS 4
+
+typedef struct num_task {
+    pcell* vals;
+    long   steps;
+    int    dibs;
+    pthread_mutex_t lock;
+} num_task;
+
+num_task** tasks;
+long data_top = 0;
+
+long
+collatz_step(long n)
+{
+    if (n % 2 == 0) {
+        return n/2;
+    }
+    else {
+        return 3*n + 1;
+    }
+}
+
+// Consumes the reference to xs
+pcell*
+iterate(pcell* xs)
+{
+    long vv = 0;
+    for (int jj = 0; vv != 1 && jj < 50; ++jj) {
+        vv = collatz_step(xs->item);
+        xs = pcons(vv, xs);
+    }
+    return xs;
+}
+
+int
+scan_and_iterate()
+{
+    long done_count = 0;
+    long base = random() % data_top;
+
+    for (long i0 = 1; i0 < data_top; ++i0) {
+        long ii = 1 + (base + i0) % (data_top - 1);
+
+        pthread_mutex_lock(&(tasks[ii]->lock));
+        int skip = tasks[ii]->dibs;
+        if (!skip) {
+            tasks[ii]->dibs = 1;
+        }
+        pthread_mutex_unlock(&(tasks[ii]->lock));
+        if (skip) {
+            continue;
+        }
+
+        pcell* xs = tasks[ii]->vals;
+        long vv = xs->item;
+
+        if (vv > 1) {
+            xs = iterate(pshare(xs));
+            prelease(tasks[ii]->vals);
+            tasks[ii]->vals = xs;
+        }
+        else {
+            if (tasks[ii]->steps == -1) {
+                tasks[ii]->steps = pcount_list(tasks[ii]->vals) - 1;
+            }
+
+            done_count += 1;
+        }
+
+        pthread_mutex_lock(&(tasks[ii]->lock));
+        tasks[ii]->dibs = 0;
+        pthread_mutex_unlock(&(tasks[ii]->lock));
+    }
+
+    return done_count == (data_top - 1);
+}
+
+void*
+worker(void* _arg)
+{
+    int done = 0;
+    while (!done) {
+        done = scan_and_iterate();
+    }
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    pthread_t threads[THREADS];
+    int rv;
+
+    if (argc != 2) {
+        printf("Usage:\n");
+        printf("\t%s TOP\n", argv[0]);
+        return 1;
+    }
+
+    data_top  = atol(argv[1]);
+
+    tasks = xmalloc(data_top * sizeof(num_task*));
+    for (int ii = 0; ii < data_top; ++ii) {
+        tasks[ii] = xmalloc(sizeof(num_task));
+        tasks[ii]->vals  = pcons(ii, 0);
+        tasks[ii]->steps = -1;
+        tasks[ii]->dibs  = 0;
+        pthread_mutex_init(&(tasks[ii]->lock), 0);
+    }
+
+    for (int ii = 0; ii < THREADS; ++ii) {
+        rv = pthread_create(&(threads[ii]), 0, worker, 0);
+        assert(rv == 0);
+    }
+
+    for (int ii = 0; ii < THREADS; ++ii) {
+        rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+    }
+
+    long max_v = 0;
+    long max_s = 0;
+
+    for (int ii = 0; ii < data_top; ++ii) {
+        if (tasks[ii]->steps > max_s) {
+            max_v = ii;
+            max_s = tasks[ii]->steps;
+        }
+    }
+
+    printf("Max steps is at %ld: %ld steps\n", max_v, max_s);
+
+    for (int ii = 0; ii < data_top; ++ii) {
+        prelease(tasks[ii]->vals);
+        xfree(tasks[ii]);
+    }
+    xfree(tasks);
+
+    return 0;
+}
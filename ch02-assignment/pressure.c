@@ -0,0 +1,150 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pressure.h"
+
+static pthread_once_t pressure_once = PTHREAD_ONCE_INIT;
+static pressure_trim trim_fn = 0;
+static int active = 0;
+static long interval_ms = 0;
+static char cgroup[PATH_MAX];
+
+// Reads a small file into buf without touching the heap being watched
+// Returns 0 if it can't be read
+static int read_file(const char* path, char* buf, size_t size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+
+  ssize_t len = read(fd, buf, size - 1);
+  close(fd);
+  if (len <= 0) {
+    return 0;
+  }
+
+  buf[len] = 0;
+  return 1;
+}
+
+// Reads a file in the cgroup directory; a path too long counts as missing
+static int read_cgroup_file(const char* name, char* buf, size_t size) {
+  char path[PATH_MAX];
+  int len = snprintf(path, sizeof(path), "%s/%s", cgroup, name);
+  return len < (int)sizeof(path) && read_file(path, buf, size);
+}
+
+// Returns -1 for a missing file or "max"
+static long read_bytes(const char* name) {
+  char buf[64];
+  if (!read_cgroup_file(name, buf, sizeof(buf)) || strncmp(buf, "max", 3) == 0) {
+    return -1;
+  }
+  return atol(buf);
+}
+
+static double read_psi() {
+  char buf[256];
+  double avg10 = 0;
+
+  if (read_cgroup_file("memory.pressure", buf, sizeof(buf))
+      || read_file("/proc/pressure/memory", buf, sizeof(buf))) {
+    sscanf(buf, "some avg10=%lf", &avg10);
+  }
+  return avg10;
+}
+
+static long resident_kb() {
+  char buf[128];
+  long pages = 0;
+  long resident = 0;
+  if (read_file("/proc/self/statm", buf, sizeof(buf))) {
+    sscanf(buf, "%ld %ld", &pages, &resident);
+  }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Falls back to the root cgroup if the path doesn't fit in PATH_MAX
+static void find_cgroup() {
+  const char* dir = getenv("XMALLOC_CGROUP");
+  char buf[PATH_MAX];
+  int len = -1;
+
+  if (dir) {
+    len = snprintf(cgroup, sizeof(cgroup), "%s", dir);
+  } else if (read_file("/proc/self/cgroup", buf, sizeof(buf)) && strncmp(buf, "0::", 3) == 0) {
+    buf[strcspn(buf, "\n")] = 0;
+    len = snprintf(cgroup, sizeof(cgroup), "/sys/fs/cgroup%s", buf + 3);
+  }
+
+  if (len < 0 || len >= (int)sizeof(cgroup)) {
+    strcpy(cgroup, "/sys/fs/cgroup");
+  }
+}
+
+static void* monitor(void* unused) {
+  struct timespec pause = {interval_ms / 1000, interval_ms % 1000 * 1000000};
+  int reported = 0;
+
+  while (1) {
+    long max = read_bytes("memory.max");
+    long current = read_bytes("memory.current");
+    double psi = read_psi();
+    int now = (max > 0 && current > max / 100 * PRESSURE_USAGE) || psi > PRESSURE_PSI;
+
+    if (now) {
+      if (!active) {
+        fprintf(stderr, "xmalloc: memory pressure (usage %ld of %ld kB, some avg10 %.2f)\n",
+                current >> 10, max >> 10, psi);
+        reported = 0;
+      }
+
+      long before = resident_kb();
+      trim_fn();
+      long released = before - resident_kb();
+      if (!reported && released > 0) {
+        fprintf(stderr, "xmalloc: trimmed %ld kB\n", released);
+        reported = 1;
+      }
+    }
+    __atomic_store_n(&active, now, __ATOMIC_RELAXED);
+
+    nanosleep(&pause, 0);
+  }
+  return 0;
+}
+
+static void start_monitor() {
+  const char* value = getenv("XMALLOC_PRESSURE");
+  interval_ms = value ? atol(value) : 0;
+  if (interval_ms <= 0) {
+    return;
+  }
+
+  find_cgroup();
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int rv = pthread_create(&thread, &attr, monitor, 0);
+  pthread_attr_destroy(&attr);
+  if (rv != 0) {
+    fprintf(stderr, "xmalloc: can't start the memory pressure monitor\n");
+  }
+}
+
+void pressure_start(pressure_trim trim) {
+  trim_fn = trim;
+  pthread_once(&pressure_once, start_monitor);
+}
+
+int pressure_active() {
+  return __atomic_load_n(&active, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,29 @@
+#ifndef PRESSURE_H
+#define PRESSURE_H
+
+// Memory pressure monitor for the xmalloc backends.
+//
+// With XMALLOC_PRESSURE=ms, a background thread checks every ms
+// milliseconds how close the process's cgroup (v2) is to its memory.max,
+// and the "some avg10" stall figure from PSI. The cgroup is found through
+// /proc/self/cgroup under /sys/fs/cgroup, or XMALLOC_CGROUP names its
+// directory (a fake one, for testing). PSI is read from memory.pressure in
+// that directory, or from /proc/pressure/memory if it has none.
+//
+// Usage above PRESSURE_USAGE percent of memory.max, or avg10 above
+// PRESSURE_PSI, is pressure. Every check under pressure calls the
+// backend's trim function to hand free memory back to the kernel. Each
+// spell is reported on stderr, along with the first trim in it that
+// shrinks the resident set.
+
+#define PRESSURE_USAGE 90
+#define PRESSURE_PSI   10.0
+
+typedef void (*pressure_trim)(void);
+
+// Starts the monitor, once, if XMALLOC_PRESSURE is set
+void pressure_start(pressure_trim trim);
+// 1 while the last check found pressure
+int pressure_active();
+
+#endif
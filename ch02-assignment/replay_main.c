@@ -0,0 +1,441 @@
+// Replays an allocation trace against an xmalloc backend.
+
+// Reads a trace written with XMALLOC_TRACE (see trace.h) and performs the
+// same allocations, reallocs and frees, with one thread per recorded
+// thread. Each thread runs its own operations in recorded order. An
+// operation on a block another thread allocated, reallocated or frees
+// waits until that thread's earlier operations on the block are done, so
+// blocks that move between threads are handled in their recorded order.
+//
+// Linked once per backend: xalloc-replay-sys, -hw7 and -par. Reports
+// throughput, per-operation latency and peak RSS.
+//
+// Untimed, the start of each xmalloc'd block is scribbled on and the
+// start of each xcalloc'd block checked for zeros, so a backend that
+// hands out a reused block from xcalloc without clearing it fails.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "xmalloc.h"
+#include "trace.h"
+
+#define OP_MALLOC  0
+#define OP_CALLOC  1
+#define OP_FREE    2
+#define OP_REALLOC 3
+
+#define NO_OBJECT UINT64_MAX
+
+// Bytes at the start of a block scribbled on or checked
+#define CHECK_BYTES 4096
+
+typedef struct replay_op {
+    uint32_t op;
+    uint32_t seq;   // operations on the object that must come first
+    uint64_t id;    // dense object number
+    uint64_t size;
+} replay_op;
+
+typedef struct replay_thread {
+    replay_op* ops;
+    long       count;
+    long       cap;
+    uint64_t   pending;  // object of an unmatched REALLOC_FROM
+    uint32_t*  lat;      // ns per operation
+    pthread_t  thread;
+} replay_thread;
+
+// Address -> object map used while assigning object ids: open addressing
+// with linear probing; deleted slots keep their key with id NO_OBJECT
+typedef struct addr_map {
+    uint64_t* keys;
+    uint64_t* ids;
+    long      mask;
+} addr_map;
+
+trace_rec* recs;
+long rec_count;
+replay_thread* threads;
+int thread_count;
+void** objects;
+uint32_t* object_seq;
+uint64_t object_count = 0;
+int start_flag = 0;
+long dirty_callocs = 0;
+
+int
+compare_recs(const void* aa, const void* bb)
+{
+    const trace_rec* xx = aa;
+    const trace_rec* yy = bb;
+
+    if (xx->time != yy->time) {
+        return xx->time < yy->time ? -1 : 1;
+    }
+    if (xx->tid != yy->tid) {
+        return xx->tid < yy->tid ? -1 : 1;
+    }
+    // Same thread, same time: keep the order they were recorded in (qsort
+    // isn't stable, so where they sit in the array says nothing)
+    return xx->seq < yy->seq ? -1 : (xx->seq > yy->seq);
+}
+
+uint64_t*
+map_slot(addr_map* mm, uint64_t addr, int insert)
+{
+    long ii = (addr >> 4) * 0x9E3779B97F4A7C15UL & mm->mask;
+    long tomb = -1;
+
+    while (mm->keys[ii] != 0) {
+        if (mm->keys[ii] == addr) {
+            if (mm->ids[ii] != NO_OBJECT || insert) {
+                return &(mm->ids[ii]);
+            }
+        }
+        else if (tomb < 0 && mm->ids[ii] == NO_OBJECT) {
+            tomb = ii;
+        }
+        ii = (ii + 1) & mm->mask;
+    }
+
+    if (!insert) {
+        return 0;
+    }
+
+    if (tomb >= 0) {
+        ii = tomb;
+    }
+    mm->keys[ii] = addr;
+    return &(mm->ids[ii]);
+}
+
+// Removes addr from the map and returns its object, or NO_OBJECT if the
+// block was allocated before tracing started
+uint64_t
+map_take(addr_map* mm, uint64_t addr)
+{
+    uint64_t* slot = map_slot(mm, addr, 0);
+    if (slot == 0) {
+        return NO_OBJECT;
+    }
+
+    uint64_t id = *slot;
+    *slot = NO_OBJECT;
+    return id;
+}
+
+void
+push_op(replay_thread* th, uint32_t op, uint64_t id, uint64_t size)
+{
+    if (th->count == th->cap) {
+        th->cap = th->cap ? th->cap * 2 : 1024;
+        th->ops = realloc(th->ops, th->cap * sizeof(replay_op));
+        assert(th->ops);
+    }
+
+    replay_op* ro = &(th->ops[th->count++]);
+    ro->op = op;
+    ro->id = id;
+    ro->size = size;
+    ro->seq = id == NO_OBJECT ? 0 : object_seq[id]++;
+}
+
+// Turns the time ordered trace into per thread operations on object ids
+void
+assign_objects()
+{
+    addr_map mm;
+    long slots = 1;
+    while (slots < rec_count * 2) {
+        slots *= 2;
+    }
+    mm.keys = calloc(slots, sizeof(uint64_t));
+    mm.ids = calloc(slots, sizeof(uint64_t));
+    mm.mask = slots - 1;
+    assert(mm.keys && mm.ids);
+
+    object_seq = calloc(rec_count + 1, sizeof(uint32_t));
+    assert(object_seq);
+
+    for (long ii = 0; ii < rec_count; ++ii) {
+        trace_rec* rr = &(recs[ii]);
+        replay_thread* th = &(threads[rr->tid]);
+        uint64_t id;
+
+        switch (rr->op) {
+        case TRACE_MALLOC:
+        case TRACE_CALLOC:
+            if (rr->addr != 0) {
+                id = object_count++;
+                *map_slot(&mm, rr->addr, 1) = id;
+                push_op(th, rr->op == TRACE_MALLOC ? OP_MALLOC : OP_CALLOC, id, rr->size);
+            }
+            break;
+        case TRACE_FREE:
+            id = rr->addr ? map_take(&mm, rr->addr) : NO_OBJECT;
+            if (id != NO_OBJECT) {
+                push_op(th, OP_FREE, id, 0);
+            }
+            break;
+        case TRACE_REALLOC_FROM:
+            th->pending = rr->addr ? map_take(&mm, rr->addr) : NO_OBJECT;
+            break;
+        case TRACE_REALLOC_TO:
+            id = th->pending;
+            th->pending = NO_OBJECT;
+            if (rr->addr == 0) {
+                // realloc to 0 bytes freed the block
+                if (id != NO_OBJECT) {
+                    push_op(th, OP_FREE, id, 0);
+                }
+            }
+            else if (id == NO_OBJECT) {
+                id = object_count++;
+                *map_slot(&mm, rr->addr, 1) = id;
+                push_op(th, OP_MALLOC, id, rr->size);
+            }
+            else {
+                *map_slot(&mm, rr->addr, 1) = id;
+                push_op(th, OP_REALLOC, id, rr->size);
+            }
+            break;
+        default:
+            fprintf(stderr, "bad trace record %ld\n", ii);
+            exit(1);
+        }
+    }
+
+    free(mm.keys);
+    free(mm.ids);
+    memset(object_seq, 0, (rec_count + 1) * sizeof(uint32_t));
+}
+
+uint64_t
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Returns 1 if the first CHECK_BYTES of a block (or all of it) are zero
+int
+is_zeroed(const uint8_t* ptr, uint64_t size)
+{
+    uint64_t bytes = size < CHECK_BYTES ? size : CHECK_BYTES;
+    for (uint64_t ii = 0; ii < bytes; ++ii) {
+        if (ptr[ii] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Waits until every earlier operation on the object, in any thread, is done
+void
+wait_turn(replay_op* ro)
+{
+    while (__atomic_load_n(&object_seq[ro->id], __ATOMIC_ACQUIRE) != ro->seq) {
+        sched_yield();
+    }
+}
+
+void*
+replay_worker(void* arg)
+{
+    replay_thread* th = arg;
+
+    while (!__atomic_load_n(&start_flag, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+
+    for (long ii = 0; ii < th->count; ++ii) {
+        replay_op* ro = &(th->ops[ii]);
+        wait_turn(ro);
+
+        uint64_t t0 = now_ns();
+        switch (ro->op) {
+        case OP_MALLOC:
+            objects[ro->id] = xmalloc(ro->size);
+            break;
+        case OP_CALLOC:
+            objects[ro->id] = xcalloc(1, ro->size);
+            break;
+        case OP_REALLOC:
+            objects[ro->id] = xrealloc(objects[ro->id], ro->size);
+            break;
+        case OP_FREE:
+            xfree(objects[ro->id]);
+            break;
+        }
+        uint64_t dt = now_ns() - t0;
+        th->lat[ii] = dt < UINT32_MAX ? dt : UINT32_MAX;
+
+        if (ro->op == OP_MALLOC && objects[ro->id]) {
+            memset(objects[ro->id], 0xa5, ro->size < CHECK_BYTES ? ro->size : CHECK_BYTES);
+        }
+        if (ro->op == OP_CALLOC && objects[ro->id] && !is_zeroed(objects[ro->id], ro->size)) {
+            __atomic_fetch_add(&dirty_callocs, 1, __ATOMIC_RELAXED);
+        }
+
+        __atomic_store_n(&object_seq[ro->id], ro->seq + 1, __ATOMIC_RELEASE);
+    }
+
+    xmalloc_flush();
+    return 0;
+}
+
+long
+status_kb(const char* field)
+{
+    char line[256];
+    long kb = -1;
+    FILE* fp = fopen("/proc/self/status", "r");
+    if (fp == 0) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, field, strlen(field)) == 0) {
+            kb = atol(line + strlen(field) + 1);
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+int
+compare_u32(const void* aa, const void* bb)
+{
+    uint32_t xx = *(const uint32_t*)aa;
+    uint32_t yy = *(const uint32_t*)bb;
+    return (xx > yy) - (xx < yy);
+}
+
+int
+main(int argc, char* argv[])
+{
+    int rv;
+
+    // Don't trace the replay
+    unsetenv("XMALLOC_TRACE");
+
+    if (argc != 2) {
+        printf("Usage:\n");
+        printf("\t%s TRACE\n", argv[0]);
+        printf("\tTRACE: file written by a run with XMALLOC_TRACE=TRACE\n");
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    struct stat st;
+    rv = fstat(fd, &st);
+    assert(rv == 0);
+    rec_count = st.st_size / sizeof(trace_rec);
+
+    recs = malloc(rec_count * sizeof(trace_rec) + 1);
+    assert(recs);
+    size_t got = 0;
+    while (got < rec_count * sizeof(trace_rec)) {
+        ssize_t nn = read(fd, (char*)recs + got, rec_count * sizeof(trace_rec) - got);
+        assert(nn > 0);
+        got += nn;
+    }
+    close(fd);
+
+    thread_count = 0;
+    for (long ii = 0; ii < rec_count; ++ii) {
+        if ((int)recs[ii].tid + 1 > thread_count) {
+            thread_count = recs[ii].tid + 1;
+        }
+    }
+
+    qsort(recs, rec_count, sizeof(trace_rec), compare_recs);
+
+    threads = calloc(thread_count, sizeof(replay_thread));
+    assert(threads);
+    for (int tt = 0; tt < thread_count; ++tt) {
+        threads[tt].pending = NO_OBJECT;
+    }
+
+    assign_objects();
+    free(recs);
+
+    objects = calloc(object_count + 1, sizeof(void*));
+    assert(objects);
+
+    long total_ops = 0;
+    for (int tt = 0; tt < thread_count; ++tt) {
+        threads[tt].lat = malloc(threads[tt].count * sizeof(uint32_t) + 1);
+        assert(threads[tt].lat);
+        total_ops += threads[tt].count;
+    }
+
+    // Reset the peak RSS so it covers the replay only (Linux 4.0+)
+    fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0) {
+        if (write(fd, "5", 1) != 1) {
+            perror("clear_refs");
+        }
+        close(fd);
+    }
+    long base_kb = status_kb("VmRSS");
+
+    for (int tt = 0; tt < thread_count; ++tt) {
+        rv = pthread_create(&(threads[tt].thread), 0, replay_worker, &(threads[tt]));
+        assert(rv == 0);
+    }
+
+    uint64_t t0 = now_ns();
+    __atomic_store_n(&start_flag, 1, __ATOMIC_RELEASE);
+
+    for (int tt = 0; tt < thread_count; ++tt) {
+        rv = pthread_join(threads[tt].thread, 0);
+        assert(rv == 0);
+    }
+
+    double secs = (now_ns() - t0) / 1e9;
+    long peak_kb = status_kb("VmHWM");
+
+    uint32_t* lat = malloc(total_ops * sizeof(uint32_t) + 1);
+    assert(lat);
+    long nn = 0;
+    for (int tt = 0; tt < thread_count; ++tt) {
+        memcpy(lat + nn, threads[tt].lat, threads[tt].count * sizeof(uint32_t));
+        nn += threads[tt].count;
+    }
+    qsort(lat, total_ops, sizeof(uint32_t), compare_u32);
+
+    printf("%s: %ld records, %d threads, %lu objects\n", argv[0], rec_count, thread_count,
+           object_count);
+    printf("ops:        %ld in %.3f s, %.0f ops/s\n", total_ops, secs, total_ops / secs);
+    if (total_ops > 0) {
+        printf("latency ns: p50 %u  p90 %u  p99 %u  p99.9 %u  max %u\n",
+               lat[total_ops / 2], lat[total_ops * 9 / 10], lat[total_ops * 99 / 100],
+               lat[total_ops * 999 / 1000], lat[total_ops - 1]);
+    }
+    printf("peak RSS:   %ld kB (%ld kB over the %ld kB before replay)\n",
+           peak_kb, peak_kb - base_kb, base_kb);
+
+    if (dirty_callocs > 0) {
+        printf("xcalloc:    %ld blocks not zeroed\n", dirty_callocs);
+        return 1;
+    }
+
+    return 0;
+}
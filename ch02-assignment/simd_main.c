@@ -0,0 +1,258 @@
+// The Collatz conjecture, vectorized.
+
+// A compute-only version of the search in list_main.c and ivec_main.c:
+// it only counts steps and never stores a sequence, so it doesn't use
+// an allocator at all. Each thread runs 4 (AVX2) or 8 (AVX-512) start
+// values per vector. The parity branch is replaced by a blend:
+//
+//   odd mask m = -(x & 1)
+//   x = (x + ((2x + 1) & m)) / 2      -- (3x+1)/2 if odd, x/2 if even
+//   steps += 1 + (x & 1)             -- an odd step is two steps
+//
+// A lane that reaches 1 records its result and is refilled with the next
+// start value, so the vector stays full until the range runs out.
+//
+// The widest kernel the CPU supports is picked at runtime (CPUID via
+// __builtin_cpu_supports). COLLATZ_KERNEL=scalar|avx2|avx512 forces one.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <immintrin.h>
+
+#define THREADS 4
+
+// Start values handed to a worker at a time
+#define CHUNK 4096
+
+typedef struct result {
+    long value;
+    long steps;
+} result;
+
+typedef void (*kernel_fn)(long lo, long hi, result* best);
+
+long data_top = 0;
+long next_start = 2;
+kernel_fn kernel;
+
+static
+void
+record(result* best, long value, long steps)
+{
+    if (steps > best->steps || (steps == best->steps && value < best->value)) {
+        best->value = value;
+        best->steps = steps;
+    }
+}
+
+static
+void
+run_scalar(long lo, long hi, result* best)
+{
+    for (long ii = lo; ii < hi; ++ii) {
+        uint64_t xx = ii;
+        long steps = 0;
+
+        while (xx != 1) {
+            uint64_t odd = xx & 1;
+            xx = (xx + (((xx << 1) | 1) & -odd)) >> 1;
+            steps += 1 + odd;
+        }
+
+        record(best, ii, steps);
+    }
+}
+
+__attribute__((target("avx2")))
+static
+void
+run_avx2(long lo, long hi, result* best)
+{
+    uint64_t xs[4], ss[4];
+    long starts[4];
+    long next = lo;
+    int active = 0;
+
+    // Idle lanes sit at 1 and are masked out of the done test
+    for (int kk = 0; kk < 4; ++kk) {
+        starts[kk] = next < hi ? next++ : 0;
+        xs[kk] = starts[kk] ? starts[kk] : 1;
+        ss[kk] = 0;
+        active |= starts[kk] ? 1 << kk : 0;
+    }
+
+    __m256i one = _mm256_set1_epi64x(1);
+    __m256i xx = _mm256_loadu_si256((__m256i*)xs);
+    __m256i steps = _mm256_loadu_si256((__m256i*)ss);
+
+    while (active) {
+        __m256i odd = _mm256_and_si256(xx, one);
+        __m256i mask = _mm256_sub_epi64(_mm256_setzero_si256(), odd);
+        __m256i up = _mm256_or_si256(_mm256_slli_epi64(xx, 1), one);
+        xx = _mm256_srli_epi64(_mm256_add_epi64(xx, _mm256_and_si256(up, mask)), 1);
+        steps = _mm256_add_epi64(steps, _mm256_add_epi64(one, odd));
+
+        int done = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(xx, one))) & active;
+        if (done) {
+            _mm256_storeu_si256((__m256i*)xs, xx);
+            _mm256_storeu_si256((__m256i*)ss, steps);
+
+            for (int kk = 0; kk < 4; ++kk) {
+                if (done & (1 << kk)) {
+                    record(best, starts[kk], ss[kk]);
+                    if (next < hi) {
+                        starts[kk] = next++;
+                        xs[kk] = starts[kk];
+                        ss[kk] = 0;
+                    }
+                    else {
+                        active &= ~(1 << kk);
+                    }
+                }
+            }
+
+            xx = _mm256_loadu_si256((__m256i*)xs);
+            steps = _mm256_loadu_si256((__m256i*)ss);
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static
+void
+run_avx512(long lo, long hi, result* best)
+{
+    uint64_t xs[8], ss[8];
+    long starts[8];
+    long next = lo;
+    __mmask8 active = 0;
+
+    for (int kk = 0; kk < 8; ++kk) {
+        starts[kk] = next < hi ? next++ : 0;
+        xs[kk] = starts[kk] ? starts[kk] : 1;
+        ss[kk] = 0;
+        active |= starts[kk] ? 1 << kk : 0;
+    }
+
+    __m512i one = _mm512_set1_epi64(1);
+    __m512i xx = _mm512_loadu_si512(xs);
+    __m512i steps = _mm512_loadu_si512(ss);
+
+    while (active) {
+        __mmask8 odd = _mm512_test_epi64_mask(xx, one);
+        __m512i up = _mm512_or_si512(_mm512_slli_epi64(xx, 1), one);
+        xx = _mm512_srli_epi64(_mm512_mask_add_epi64(xx, odd, xx, up), 1);
+        steps = _mm512_mask_add_epi64(_mm512_add_epi64(steps, one), odd, steps,
+                                      _mm512_set1_epi64(2));
+
+        __mmask8 done = _mm512_cmpeq_epi64_mask(xx, one) & active;
+        if (done) {
+            _mm512_storeu_si512(xs, xx);
+            _mm512_storeu_si512(ss, steps);
+
+            for (int kk = 0; kk < 8; ++kk) {
+                if (done & (1 << kk)) {
+                    record(best, starts[kk], ss[kk]);
+                    if (next < hi) {
+                        starts[kk] = next++;
+                        xs[kk] = starts[kk];
+                        ss[kk] = 0;
+                    }
+                    else {
+                        active &= ~(1 << kk);
+                    }
+                }
+            }
+
+            xx = _mm512_loadu_si512(xs);
+            steps = _mm512_loadu_si512(ss);
+        }
+    }
+}
+
+static
+kernel_fn
+pick_kernel()
+{
+    const char* name = getenv("COLLATZ_KERNEL");
+    __builtin_cpu_init();
+
+    int avx512 = __builtin_cpu_supports("avx512f");
+    int avx2 = __builtin_cpu_supports("avx2");
+
+    if (name && strcmp(name, "scalar") == 0) {
+        return run_scalar;
+    }
+    if (avx512 && !(name && strcmp(name, "avx2") == 0)) {
+        return run_avx512;
+    }
+    if (avx2) {
+        return run_avx2;
+    }
+    return run_scalar;
+}
+
+void*
+worker(void* arg)
+{
+    result* best = arg;
+
+    while (1) {
+        long start = __atomic_fetch_add(&next_start, CHUNK, __ATOMIC_RELAXED);
+        if (start >= data_top) {
+            break;
+        }
+
+        long end = start + CHUNK < data_top ? start + CHUNK : data_top;
+        kernel(start, end, best);
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    pthread_t threads[THREADS];
+    result best[THREADS];
+    int rv;
+
+    if (argc != 2) {
+        printf("Usage:\n");
+        printf("\t%s TOP\n", argv[0]);
+        return 1;
+    }
+
+    data_top = atol(argv[1]);
+    kernel = pick_kernel();
+
+    for (int ii = 0; ii < THREADS; ++ii) {
+        best[ii].value = 0;
+        best[ii].steps = 0;
+        rv = pthread_create(&(threads[ii]), 0, worker, &(best[ii]));
+        assert(rv == 0);
+    }
+
+    for (int ii = 0; ii < THREADS; ++ii) {
+        rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+    }
+
+    long max_v = 0;
+    long max_s = 0;
+
+    for (int ii = 0; ii < THREADS; ++ii) {
+        if (best[ii].steps > max_s || (best[ii].steps == max_s && best[ii].value < max_v)) {
+            max_v = best[ii].value;
+            max_s = best[ii].steps;
+        }
+    }
+
+    printf("Max steps is at %ld: %ld steps\n", max_v, max_s);
+
+    return 0;
+}
@@ -0,0 +1,166 @@
+// The Collatz conjecture, with a structure-of-arrays task table.
+
+// Same search and the same 50-steps-per-claim scheduling as ivec_main.c,
+// but without a num_task allocation, mutex and sequence per task. Tasks
+// live in three contiguous arrays (current value, steps so far, state),
+// so setup is three allocations regardless of TOP. Sequences are never
+// stored: task_sequence() replays one from its start value on demand.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <assert.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+#include "ivec.h"
+
+#define THREADS 4
+
+// Task states, stored one byte per task
+#define PENDING 0
+#define CLAIMED 1
+#define DONE    2
+
+long*     task_vals;
+uint16_t* task_steps;
+uint8_t*  task_state;
+long data_top = 0;
+long done_count = 0;
+
+long
+collatz_step(long n)
+{
+    if (n % 2 == 0) {
+        return n/2;
+    }
+    else {
+        return 3*n + 1;
+    }
+}
+
+// Builds the sequence a task has produced so far, from its start value
+ivec*
+task_sequence(long ii)
+{
+    long steps = __atomic_load_n(&task_steps[ii], __ATOMIC_ACQUIRE);
+    ivec* xs = make_ivec(steps + 1);
+    long vv = ii;
+
+    ivec_push(xs, vv);
+    for (long jj = 0; jj < steps; ++jj) {
+        vv = collatz_step(vv);
+        ivec_push(xs, vv);
+    }
+
+    return xs;
+}
+
+void
+scan_and_iterate()
+{
+    long base = random() % data_top;
+
+    for (long i0 = 1; i0 < data_top; ++i0) {
+        long ii = 1 + (base + i0) % (data_top - 1);
+
+        uint8_t state = PENDING;
+        if (!__atomic_compare_exchange_n(&task_state[ii], &state, CLAIMED, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;
+        }
+
+        long vv = task_vals[ii];
+        long steps = task_steps[ii];
+        for (int jj = 0; vv > 1 && jj < 50; ++jj) {
+            vv = collatz_step(vv);
+            steps++;
+        }
+
+        task_vals[ii] = vv;
+        __atomic_store_n(&task_steps[ii], steps, __ATOMIC_RELEASE);
+
+        if (vv > 1) {
+            __atomic_store_n(&task_state[ii], PENDING, __ATOMIC_RELEASE);
+        }
+        else {
+            __atomic_store_n(&task_state[ii], DONE, __ATOMIC_RELEASE);
+            __atomic_fetch_add(&done_count, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void*
+worker(void* _arg)
+{
+    while (__atomic_load_n(&done_count, __ATOMIC_RELAXED) < data_top - 1) {
+        scan_and_iterate();
+    }
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    pthread_t threads[THREADS];
+    int rv;
+
+    if (argc != 2 && argc != 3) {
+        printf("Usage:\n");
+        printf("\t%s TOP [SHOW]\n", argv[0]);
+        printf("\tSHOW: also print the sequence starting at SHOW\n");
+        return 1;
+    }
+
+    data_top  = atol(argv[1]);
+    assert(data_top > 1);
+
+    task_vals  = xmalloc(data_top * sizeof(long));
+    task_steps = xcalloc(data_top, sizeof(uint16_t));
+    task_state = xcalloc(data_top, sizeof(uint8_t));  // all PENDING
+
+    for (long ii = 0; ii < data_top; ++ii) {
+        task_vals[ii] = ii;
+    }
+    task_state[0] = DONE;
+
+    for (int ii = 0; ii < THREADS; ++ii) {
+        rv = pthread_create(&(threads[ii]), 0, worker, 0);
+        assert(rv == 0);
+    }
+
+    for (int ii = 0; ii < THREADS; ++ii) {
+        rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+    }
+
+    long max_v = 0;
+    long max_s = 0;
+
+    for (long ii = 0; ii < data_top; ++ii) {
+        if (task_steps[ii] > max_s) {
+            max_v = ii;
+            max_s = task_steps[ii];
+        }
+    }
+
+    printf("Max steps is at %ld: %ld steps\n", max_v, max_s);
+
+    if (argc == 3) {
+        long show = atol(argv[2]);
+        assert(show > 0 && show < data_top);
+
+        ivec* xs = task_sequence(show);
+        for (long ii = 0; ii < xs->size; ++ii) {
+            printf("%ld%s", xs->data[ii], ii + 1 < xs->size ? " " : "\n");
+        }
+        free_ivec(xs);
+    }
+
+    xfree(task_state);
+    xfree(task_steps);
+    xfree(task_vals);
+
+    return 0;
+}
@@ -1,26 +1,82 @@
 
+#include <malloc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #include "xmalloc.h"
+#include "trace.h"
+#include "pressure.h"
+#include "heapdump.h"
 
 
 void*
 xmalloc(size_t bytes)
 {
-    return malloc(bytes);
+    void* ptr = malloc(bytes);
+    TRACE(TRACE_MALLOC, ptr, bytes);
+    return ptr;
 }
 
 void
 xfree(void* ptr)
 {
+    TRACE(TRACE_FREE, ptr, 0);
     free(ptr);
 }
 
+void*
+xcalloc(size_t nmemb, size_t bytes)
+{
+    void* ptr = calloc(nmemb, bytes);
+    TRACE(TRACE_CALLOC, ptr, nmemb * bytes);
+    return ptr;
+}
+
 void*
 xrealloc(void* prev, size_t bytes)
 {
-    return realloc(prev, bytes);
+    TRACE(TRACE_REALLOC_FROM, prev, 0);
+    void* ptr = realloc(prev, bytes);
+    TRACE(TRACE_REALLOC_TO, ptr, bytes);
+    return ptr;
+}
+
+size_t
+xmalloc_usable_size(void* ptr)
+{
+    return malloc_usable_size(ptr);
+}
+
+// free() is never deferred here
+void
+xmalloc_flush()
+{
+}
+
+static void
+trim_heap()
+{
+    malloc_trim(0);
+}
+
+// glibc keeps no per-chunk occupancy we can read cheaply; mallinfo2
+// gives the totals
+void
+xmalloc_dump_heap(FILE* out)
+{
+    struct mallinfo2 mi = mallinfo2();
+    fprintf(out, "{\"backend\":\"sys\",\"arena_bytes\":%zu,\"mmap_bytes\":%zu,"
+            "\"mmap_blocks\":%zu,\"summary\":{\"used_bytes\":%zu,\"free_bytes\":%zu,"
+            "\"releasable\":%zu,\"rss\":%zu}}\n", mi.arena, mi.hblkhd, mi.hblks,
+            mi.uordblks, mi.fordblks, mi.keepcost, heapdump_rss());
+    fflush(out);
 }
 
+__attribute__((constructor))
+static void
+start_monitors()
+{
+    pressure_start(trim_heap);
+    heapdump_start();
+}
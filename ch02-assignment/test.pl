@@ -4,7 +4,8 @@ use warnings FATAL => 'all';
 use POSIX ":sys_wait_h";
 
 use Time::HiRes qw(time);
-use Test::Simple tests => 13;
+use JSON::PP;
+use Test::Simple tests => 51;
 
 sub get_time {
     my $data = `cat time.tmp | grep ^real`;
@@ -65,6 +66,209 @@ my $pl_ok = $par_l =~ /at 871: 178 steps/;
 ok($pl_ok, "list-par 1k");
 ok($pl_ok && $t_pl < $t_sl, "list-par beat system time");
 
+my $sivec_s = run_prog("collatz-sivec-sys", 1000);
+ok($sivec_s =~ /at 871: 178 steps/, "sivec-sys 1k");
+
+my $sivec_h = run_prog("collatz-sivec-hw7", 100);
+ok($sivec_h =~ /at 97: 118 steps/, "sivec-hw7 100");
+
+my $sivec_p = run_prog("collatz-sivec-par", 1000);
+ok($sivec_p =~ /at 871: 178 steps/, "sivec-par 1k");
+
+my $ws_s = run_prog("collatz-ws-sys", 1000);
+ok($ws_s =~ /at 871: 178 steps/, "ws-sys 1k");
+
+my $ws_h = run_prog("collatz-ws-hw7", 100);
+ok($ws_h =~ /at 97: 118 steps/, "ws-hw7 100");
+
+my $ws_p = run_prog("collatz-ws-par", 1000);
+ok($ws_p =~ /at 871: 178 steps/, "ws-par 1k");
+
+my $plist_h = run_prog("collatz-plist-hw7", 1000);
+ok($plist_h =~ /at 871: 178 steps/, "plist-hw7 1k");
+
+my $plist_p = run_prog("collatz-plist-par", 1000);
+ok($plist_p =~ /at 871: 178 steps/, "plist-par 1k");
+
+my $ulist_h = run_prog("collatz-ulist-hw7", 1000);
+ok($ulist_h =~ /at 871: 178 steps/, "ulist-hw7 1k");
+
+my $ulist_p = run_prog("collatz-ulist-par", 1000);
+ok($ulist_p =~ /at 871: 178 steps/, "ulist-par 1k");
+
+my $memo = run_prog("collatz-memo", 1000000);
+ok($memo =~ /at 837799: 524 steps/, "memo 1M");
+
+my $soa = run_prog("collatz-soa", 1000);
+ok($soa =~ /at 871: 178 steps/, "soa 1k");
+
+my $soa_show = run_prog("collatz-soa", "1000 6");
+ok($soa_show =~ /^6 3 10 5 16 8 4 2 1$/m, "soa 1k, sequence from 6");
+
+my $simd = run_prog("collatz-simd", 1000000);
+ok($simd =~ /at 837799: 524 steps/, "simd 1M");
+
+{
+    local $ENV{XMALLOC_DEFER} = 64;
+
+    my $defer_h = run_prog("collatz-list-hw7", 100);
+    ok($defer_h =~ /at 97: 118 steps/, "list-hw7 deferred free 100");
+
+    my $defer_p = run_prog("collatz-list-par", 1000);
+    ok($defer_p =~ /at 871: 178 steps/, "list-par deferred free 1k");
+}
+
+{
+    local $ENV{PAR_CONFIG} = "arenas=1,cache=16,slab=256K";
+    my $conf_p = run_prog("collatz-list-par", 1000);
+    ok($conf_p =~ /at 871: 178 steps/, "list-par 1k, one arena, small caches");
+}
+
+{
+    # Far over the limit from the start: no arenas open, caches shrink
+    local $ENV{PAR_CONFIG} = "adapt=1,limit=1M";
+    my $adapt_p = run_prog("collatz-ws-par", 10000);
+    ok($adapt_p =~ /at 6171: 261 steps/, "ws-par 10k, adaptive over its limit");
+}
+
+{
+    local $ENV{PAR_CONFIG} = "arenas=2,bogus=1";
+    my $bad = `./collatz-ivec-par 1000 2>&1`;
+    ok($bad =~ /unknown PAR_CONFIG setting 'bogus'/ && $bad =~ /at 871: 178 steps/,
+       "unknown PAR_CONFIG setting reported");
+}
+
+{
+    # Second run reopens the heap file and checks the root left by the first
+    local $ENV{PAR_HEAP_FILE} = "heap.tmp";
+    unlink("heap.tmp");
+    my $made = run_prog("collatz-persist", 10000);
+    my $back = run_prog("collatz-persist", 10000);
+    ok($made =~ /at 6171: 261 steps/ && $made !~ /Resumed/, "persist 10k, new heap");
+    ok($back =~ /Resumed/ && $back =~ /at 6171: 261 steps/, "persist 10k, reopened heap");
+
+    # Each run replaces its blocks; nothing left cached at exit may pile up
+    local $ENV{XMALLOC_DUMP} = "dump.tmp";
+    system("rm -f dump.tmp");
+    run_prog("collatz-persist", 10000) for 1 .. 3;
+    my @used = map { eval { decode_json($_)->{summary}{used_bytes} } } split(/\n/, `cat dump.tmp`);
+    ok(@used == 3 && $used[0] > 0 && $used[0] == $used[1] && $used[1] == $used[2],
+       "persist 10k, heap use stable over reopens");
+    unlink("heap.tmp", "dump.tmp");
+}
+
+{
+    local $ENV{XMALLOC_TRACE} = "trace.tmp";
+    run_prog("collatz-ivec-sys", 1000);
+}
+
+my $replay = run_prog("xalloc-replay-par", "trace.tmp");
+ok($replay =~ /ops:\s+\d+ in/, "replay ivec-sys trace on par");
+
+{
+    # Each block is freed dirty, then its size asked for again with xcalloc
+    open(my $fh, ">", "trace.tmp") or die;
+    binmode($fh);
+    my $tt = 0;
+    for my $size (24, 1000, 3000) {
+        my $addr = $size * 4096;
+        print $fh pack("QQQQLL", $tt, $tt, $addr, $size, 0, 0); $tt++;
+        print $fh pack("QQQQLL", $tt, $tt, $addr, 0, 0, 2); $tt++;
+        print $fh pack("QQQQLL", $tt, $tt, $addr, $size, 0, 1); $tt++;
+    }
+    close($fh);
+
+    for my $backend ("sys", "hw7", "par") {
+        my $out = run_prog("xalloc-replay-$backend", "trace.tmp");
+        ok($out =~ /ops:\s+9 in/ && $out !~ /not zeroed/, "$backend xcalloc zeroes a reused block");
+    }
+}
+
+{
+    # Freeing two neighbours leaves a 4104 byte cell, 9 bytes over a
+    # 4087 byte request: too little to split it, too big to take whole
+    open(my $fh, ">", "trace.tmp") or die;
+    binmode($fh);
+    my @recs = ([1, 2040, 0], [2, 2040, 0], [3, 2048, 0], [4, 100, 0],
+                [2, 0, 2], [3, 0, 2], [5, 4087, 0], [5, 0, 2]);
+    for my $tt (0 .. $#recs) {
+        my ($id, $size, $op) = @{$recs[$tt]};
+        print $fh pack("QQQQLL", $tt, $tt, $id * 4096, $size, 0, $op);
+    }
+    close($fh);
+
+    for my $backend ("sys", "hw7", "par") {
+        my $out = run_prog("xalloc-replay-$backend", "trace.tmp");
+        ok($out =~ /ops:\s+8 in/, "$backend replays a page-sized take from a joined cell");
+    }
+}
+
+{
+    # A fake cgroup at 99% of its memory.max: trimming runs all along
+    system("mkdir -p cgroup.tmp");
+    system("echo 1000000 > cgroup.tmp/memory.max");
+    system("echo 990000 > cgroup.tmp/memory.current");
+    system("echo 'some avg10=0.00 avg60=0.00 avg300=0.00 total=0' > cgroup.tmp/memory.pressure");
+    local $ENV{XMALLOC_PRESSURE} = 10;
+    local $ENV{XMALLOC_CGROUP} = "cgroup.tmp";
+
+    my $press_h = `./collatz-list-hw7 1000 2>&1`;
+    ok($press_h =~ /memory pressure/ && $press_h =~ /at 871: 178 steps/,
+       "list-hw7 1k under memory pressure");
+
+    my $press_p = `./collatz-list-par 1000 2>&1`;
+    ok($press_p =~ /memory pressure/ && $press_p =~ /at 871: 178 steps/,
+       "list-par 1k under memory pressure");
+}
+
+{
+    # Without a SIGUSR1, the only report is the one at exit
+    local $ENV{XMALLOC_DUMP} = "dump.tmp";
+    system("rm -f dump.tmp");
+    run_prog("collatz-list-par", 1000);
+    run_prog("collatz-list-hw7", 100);
+}
+
+my @dumps = map { eval { decode_json($_) } } split(/\n/, `cat dump.tmp`);
+ok(@dumps == 2 && $dumps[0]{backend} eq "par" && @{$dumps[0]{slabs}} > 0,
+   "par heap dump at exit");
+ok(@dumps == 2 && $dumps[1]{backend} eq "hw7" && $dumps[1]{summary}{used_bytes} == 0,
+   "hw7 heap dump at exit");
+
+for my $backend ("sys", "hw7", "par") {
+    my $bench = run_prog("xmalloc-bench-$backend", 2);
+    my @ns = $bench =~ /^(churn|batch|realloc|calloc)\s+ns\s+\d/mg;
+    ok(@ns == 4, "$backend bench smoke run");
+}
+
+# A fake sysfs node directory, one cpu per node
+sub fake_numa {
+    my ($nodes) = @_;
+    system("rm -rf numa.tmp; mkdir numa.tmp; echo 0-" . ($nodes - 1) . " > numa.tmp/online");
+    for my $nn (0 .. $nodes - 1) {
+        system("mkdir numa.tmp/node$nn; echo $nn > numa.tmp/node$nn/cpulist");
+    }
+}
+
+# Runs list-par under the fake topology; true if it gets the right answer
+# and every slab's arena is on the node given for it in @$expect
+sub numa_check {
+    my ($nodes, $expect) = @_;
+    fake_numa($nodes);
+    local $ENV{PAR_NUMA_SYSFS} = "numa.tmp";
+    local $ENV{XMALLOC_DUMP} = "dump.tmp";
+    system("rm -f dump.tmp");
+    my $out = run_prog("collatz-list-par", 1000);
+    my $dump = eval { decode_json(`cat dump.tmp`) };
+    system("rm -rf numa.tmp dump.tmp");
+    return 0 unless $out =~ /at 871: 178 steps/ && $dump && @{$dump->{slabs}} > 0;
+    return !grep { $_->{node} != $expect->[$_->{arena}] } @{$dump->{slabs}};
+}
+
+ok(numa_check(2, [0, 0, 1, 1]), "list-par 1k, two fake NUMA nodes");
+# Nodes 0 and 1 share arena 0, and 3 and 4 share arena 2: neither is bound
+ok(numa_check(6, [-1, 2, -1, 5]), "list-par 1k, more fake NUMA nodes than arenas");
+
 sub clang_check {
     my $errs = `clang-check *.c -- 2>&1`;
     chomp $errs;
@@ -0,0 +1,90 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// Records per thread buffer (160 KB)
+#define TRACE_BUF 4096
+
+int trace_state = -1;
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static int trace_fd = -1;
+static uint32_t trace_threads = 0;
+
+static __thread trace_rec* trace_buf = 0;
+static __thread int trace_count = 0;
+static __thread uint32_t trace_tid;
+static __thread uint64_t trace_seq = 0;
+
+static void trace_flush() {
+  if (trace_count > 0) {
+    size_t bytes = trace_count * sizeof(trace_rec);
+    ssize_t wrote = write(trace_fd, trace_buf, bytes);
+    assert(wrote == (ssize_t)bytes);
+    trace_count = 0;
+  }
+}
+
+static void trace_thread_exit(void* unused) {
+  trace_flush();
+}
+
+static void trace_process_exit() {
+  trace_flush();
+}
+
+static void trace_open() {
+  const char* path = getenv("XMALLOC_TRACE");
+
+  if (path == 0 || *path == 0) {
+    __atomic_store_n(&trace_state, 0, __ATOMIC_RELEASE);
+    return;
+  }
+
+  // Appends of a whole buffer don't interleave with other threads'
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  assert(trace_fd >= 0);
+
+  int rv = pthread_key_create(&trace_key, trace_thread_exit);
+  assert(rv == 0);
+  atexit(trace_process_exit);
+
+  __atomic_store_n(&trace_state, 1, __ATOMIC_RELEASE);
+}
+
+void trace_init() {
+  pthread_once(&trace_once, trace_open);
+}
+
+void trace_record(int op, void* addr, size_t size) {
+  if (trace_buf == 0) {
+    // Mapped rather than allocated, so tracing doesn't trace itself
+    trace_buf = mmap(0, TRACE_BUF * sizeof(trace_rec), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(trace_buf != MAP_FAILED);
+    trace_tid = __atomic_fetch_add(&trace_threads, 1, __ATOMIC_RELAXED);
+    pthread_setspecific(trace_key, trace_buf);
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  trace_rec* rec = &trace_buf[trace_count++];
+  rec->time = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+  rec->seq = trace_seq++;
+  rec->addr = (uintptr_t)addr;
+  rec->size = size;
+  rec->tid = trace_tid;
+  rec->op = op;
+
+  if (trace_count == TRACE_BUF) {
+    trace_flush();
+  }
+}
@@ -0,0 +1,58 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Allocation trace recorder for the xmalloc layer.
+//
+// With XMALLOC_TRACE=path, every xmalloc, xcalloc, xrealloc and xfree is
+// appended to path as a fixed size binary record. Each thread fills its
+// own buffer and writes it out in one append when it is full, when the
+// thread exits, and at process exit. xalloc-replay (replay_main.c) plays
+// a trace back against any backend.
+//
+// Blocks are identified by address. Frees are stamped before the block
+// is released and allocations after they return, so sorting a trace by
+// time never shows an address handed out again before it was freed, and
+// records of one thread with equal times keep their order by seq. A
+// realloc is two records: REALLOC_FROM (the old block, stamped before)
+// and REALLOC_TO (the new one, stamped after), back to back in its
+// thread's stream.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_MALLOC       0
+#define TRACE_CALLOC       1
+#define TRACE_FREE         2
+#define TRACE_REALLOC_FROM 3
+#define TRACE_REALLOC_TO   4
+
+typedef struct trace_rec {
+  uint64_t time;  // ns, CLOCK_MONOTONIC
+  uint64_t seq;   // position in its thread's stream, orders equal times
+  uint64_t addr;  // the block
+  uint64_t size;  // bytes requested (nmemb * size for calloc)
+  uint32_t tid;   // threads are numbered from 0 in order of first use
+  uint32_t op;
+} trace_rec;
+
+// -1 until the first call decides, then 0 (off) or 1 (recording)
+extern int trace_state;
+
+void trace_init();
+void trace_record(int op, void* addr, size_t size);
+
+static inline int trace_enabled() {
+  if (__builtin_expect(trace_state < 0, 0)) {
+    trace_init();
+  }
+  return trace_state;
+}
+
+#define TRACE(op, addr, size)              \
+  do {                                     \
+    if (trace_enabled()) {                 \
+      trace_record((op), (addr), (size));  \
+    }                                      \
+  } while (0)
+
+#endif
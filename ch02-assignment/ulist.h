@@ -0,0 +1,90 @@
+#ifndef ULIST_H
+#define ULIST_H
+
+#include "xmalloc.h"
+
+// Unrolled linked list: each node is one cache line, so a list of n
+// items is n / ULIST_ITEMS allocations and scanning it is mostly
+// sequential. The head of the list is the last item of the first node.
+#define ULIST_LINE 64
+// A line less the count and rest fields (16 bytes with padding)
+#define ULIST_ITEMS ((int)((ULIST_LINE - 2 * sizeof(void*)) / sizeof(long)))
+
+typedef struct unode {
+    long          items[ULIST_ITEMS];
+    int           count;
+    struct unode* rest;
+} unode;
+
+_Static_assert(sizeof(unode) == ULIST_LINE, "unode should fill one cache line");
+
+static
+long
+uhead(unode* xs)
+{
+    return xs->items[xs->count - 1];
+}
+
+// Takes over xs: fills its first node in place while there is room
+static
+unode*
+ucons(long item, unode* xs)
+{
+    if (xs == 0 || xs->count == ULIST_ITEMS) {
+        unode* ys = xmalloc(sizeof(unode));
+        ys->count = 0;
+        ys->rest = xs;
+        xs = ys;
+    }
+
+    xs->items[xs->count++] = item;
+    return xs;
+}
+
+static
+long
+count_ulist(unode* xs)
+{
+    long nn = 0;
+    while (xs) {
+        nn += xs->count;
+        xs = xs->rest;
+    }
+    return nn;
+}
+
+static
+void
+free_ulist(unode* xs)
+{
+    while (xs) {
+        unode* ys = xs->rest;
+        xfree(xs);
+        xs = ys;
+    }
+}
+
+static
+unode*
+copy_ulist(unode* xs)
+{
+    unode* head = 0;
+    unode** tail = &head;
+
+    while (xs) {
+        unode* ys = xmalloc(sizeof(unode));
+        for (int ii = 0; ii < xs->count; ++ii) {
+            ys->items[ii] = xs->items[ii];
+        }
+        ys->count = xs->count;
+        ys->rest = 0;
+
+        *tail = ys;
+        tail = &ys->rest;
+        xs = xs->rest;
+    }
+
+    return head;
+}
+
+#endif
@@ -0,0 +1,271 @@
+// The Collatz conjecture, with a work-stealing scheduler.
+
+// Same search and the same ivec workload as ivec_main.c, but instead of
+// every thread sweeping every task looking for one it can take, each thread
+// owns a Chase-Lev deque of task ranges. A thread splits ranges off the
+// bottom of its own deque and, when that runs dry, steals the largest
+// range from the top of another thread's deque. Tasks are claimed with an
+// atomic dibs flag and finished tasks are counted in one global counter,
+// so nothing is ever rescanned.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+#include "ivec.h"
+
+#define THREADS 4
+
+// Ranges at most this long are run rather than split
+#define GRAIN 64
+// Deque capacity; splitting in halves needs about log2(TOP / GRAIN) slots
+#define DEQUE_SIZE 256
+// Failed steals in a row after which a thief yields the cpu on each miss
+#define STEAL_MISSES THREADS
+
+// A range of task indexes [lo, hi) packed as (lo << 32) | hi so the
+// deque can move it with single word atomics
+#define RANGE(lo, hi) (((uint64_t)(lo) << 32) | (uint64_t)(hi))
+#define RANGE_LO(rr)  ((long)((rr) >> 32))
+#define RANGE_HI(rr)  ((long)((rr) & 0xFFFFFFFF))
+#define EMPTY 0
+#define ABORT 1
+
+typedef struct num_task {
+    ivec* vals;
+    long  steps;
+    char  dibs;
+} num_task;
+
+typedef struct deque {
+    long top;
+    long bottom;
+    uint64_t items[DEQUE_SIZE];
+} __attribute__((aligned(64))) deque;
+
+num_task** tasks;
+long data_top = 0;
+long done_count = 0;
+deque deques[THREADS];
+
+// Owner only: push onto the bottom
+void
+deque_push(deque* dq, uint64_t rr)
+{
+    long bb = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+    long tt = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    assert(bb - tt < DEQUE_SIZE);
+
+    __atomic_store_n(&dq->items[bb % DEQUE_SIZE], rr, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&dq->bottom, bb + 1, __ATOMIC_RELAXED);
+}
+
+// Owner only: pop from the bottom
+uint64_t
+deque_take(deque* dq)
+{
+    long bb = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&dq->bottom, bb, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long tt = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+
+    if (tt > bb) {
+        __atomic_store_n(&dq->bottom, bb + 1, __ATOMIC_RELAXED);
+        return EMPTY;
+    }
+
+    uint64_t rr = __atomic_load_n(&dq->items[bb % DEQUE_SIZE], __ATOMIC_RELAXED);
+    if (tt == bb) {
+        // Last item: race the thieves for it
+        if (!__atomic_compare_exchange_n(&dq->top, &tt, tt + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            rr = EMPTY;
+        }
+        __atomic_store_n(&dq->bottom, bb + 1, __ATOMIC_RELAXED);
+    }
+
+    return rr;
+}
+
+// Any thread: pop from the top
+uint64_t
+deque_steal(deque* dq)
+{
+    long tt = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bb = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+
+    if (tt >= bb) {
+        return EMPTY;
+    }
+
+    uint64_t rr = __atomic_load_n(&dq->items[tt % DEQUE_SIZE], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&dq->top, &tt, tt + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return ABORT;
+    }
+
+    return rr;
+}
+
+long
+collatz_step(long n)
+{
+    if (n % 2 == 0) {
+        return n/2;
+    }
+    else {
+        return 3*n + 1;
+    }
+}
+
+ivec*
+iterate(ivec* xs)
+{
+    long vv = 0;
+    for (int jj = 0; vv != 1 && jj < 50; ++jj) {
+        vv = collatz_step(ivec_last(xs));
+        ivec_push(xs, vv);
+    }
+    return xs;
+}
+
+// Runs one task to completion, 50 steps at a time like ivec_main.c
+void
+run_task(num_task* task)
+{
+    if (__atomic_exchange_n(&task->dibs, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    while (ivec_last(task->vals) > 1) {
+        ivec* xs = ivec_copy(task->vals);
+        xs = iterate(xs);
+        free_ivec(task->vals);
+        task->vals = xs;
+    }
+
+    task->steps = task->vals->size - 1;
+    __atomic_fetch_add(&done_count, 1, __ATOMIC_RELEASE);
+}
+
+void
+run_range(deque* dq, uint64_t rr)
+{
+    long lo = RANGE_LO(rr);
+    long hi = RANGE_HI(rr);
+
+    // Leave the upper halves where thieves can find them
+    while (hi - lo > GRAIN) {
+        long mid = lo + (hi - lo) / 2;
+        deque_push(dq, RANGE(mid, hi));
+        hi = mid;
+    }
+
+    for (long ii = lo; ii < hi; ++ii) {
+        run_task(tasks[ii]);
+    }
+}
+
+void*
+worker(void* arg)
+{
+    long self = (long)arg;
+    deque* dq = &(deques[self]);
+    unsigned seed = self;
+    int misses = 0;
+
+    while (__atomic_load_n(&done_count, __ATOMIC_ACQUIRE) < data_top - 1) {
+        uint64_t rr = deque_take(dq);
+
+        if (rr == EMPTY) {
+            long victim = rand_r(&seed) % THREADS;
+            rr = victim == self ? EMPTY : deque_steal(&(deques[victim]));
+
+            if (rr == EMPTY || rr == ABORT) {
+                // Near the end most deques are empty: rather than spin on
+                // them, let the threads still holding work run
+                if (++misses >= STEAL_MISSES) {
+                    sched_yield();
+                }
+                continue;
+            }
+        }
+
+        misses = 0;
+        run_range(dq, rr);
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    pthread_t threads[THREADS];
+    int rv;
+
+    if (argc != 2) {
+        printf("Usage:\n");
+        printf("\t%s TOP\n", argv[0]);
+        return 1;
+    }
+
+    data_top  = atol(argv[1]);
+    assert(data_top > 1 && data_top < (1L << 32));
+
+    tasks = xmalloc(data_top * sizeof(num_task*));
+    for (long ii = 0; ii < data_top; ++ii) {
+        tasks[ii] = xmalloc(sizeof(num_task));
+        ivec* xs = make_ivec(4);
+        ivec_push(xs, ii);
+        tasks[ii]->vals  = xs;
+        tasks[ii]->steps = -1;
+        tasks[ii]->dibs  = 0;
+    }
+
+    // Deal tasks 1 .. TOP-1 out evenly; stealing balances the rest
+    for (long ii = 0; ii < THREADS; ++ii) {
+        long lo = 1 + (data_top - 1) * ii / THREADS;
+        long hi = 1 + (data_top - 1) * (ii + 1) / THREADS;
+        if (hi > lo) {
+            deque_push(&(deques[ii]), RANGE(lo, hi));
+        }
+    }
+
+    for (long ii = 0; ii < THREADS; ++ii) {
+        rv = pthread_create(&(threads[ii]), 0, worker, (void*)ii);
+        assert(rv == 0);
+    }
+
+    for (int ii = 0; ii < THREADS; ++ii) {
+        rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+    }
+
+    long max_v = 0;
+    long max_s = 0;
+
+    for (long ii = 0; ii < data_top; ++ii) {
+        if (tasks[ii]->steps > max_s) {
+            max_v = ii;
+            max_s = tasks[ii]->steps;
+        }
+    }
+
+    printf("Max steps is at %ld: %ld steps\n", max_v, max_s);
+
+    for (long ii = 0; ii < data_top; ++ii) {
+        free_ivec(tasks[ii]->vals);
+        xfree(tasks[ii]);
+    }
+    xfree(tasks);
+
+    return 0;
+}
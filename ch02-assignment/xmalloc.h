@@ -2,9 +2,59 @@
 #define XMALLOC_H
 
 #include <stddef.h>
+#include <stdio.h>
+
+void* xcalloc(size_t nmemb, size_t bytes);
+void* xrealloc(void* prev, size_t bytes);
+// Bytes actually usable at ptr, which may be more than were requested
+size_t xmalloc_usable_size(void* ptr);
+// Releases this thread's deferred frees now (see defer.h)
+void  xmalloc_flush();
+// Writes a one line JSON report of heap occupancy and fragmentation
+// (see heapdump.h)
+void  xmalloc_dump_heap(FILE* out);
+
+#ifdef XMALLOC_PAR
+
+// Drivers built against par_malloc (-DXMALLOC_PAR) pop and push the
+// thread's cache of 16 and 32 byte blocks right here; anything else, an
+// empty cache or a full one, goes out of line. The out-of-line xmalloc and
+// xfree are still there for callers built without the flag.
+#include <stdint.h>
+#include "par_malloc.h"
+
+static inline void* xmalloc(size_t bytes) {
+  if (bytes - 1 < ((size_t)16 << (LINE_CLASSES - 1))) {
+    int cls = (bytes - 1) >> 4;
+    void* ptr = xcache_head[cls];
+    if (__builtin_expect(ptr != 0, 1)) {
+      xcache_head[cls] = *(void**)ptr;
+      xcache_count[cls]--;
+      return ptr;
+    }
+  }
+  return xmalloc_slow(bytes);
+}
+
+static inline void xfree(void* ptr) {
+  // Null and pointers outside the slab space land out of line
+  uintptr_t off = (uint8_t*)ptr - slab_space;
+  int cls = (off >> REGION_SHIFT) % 8;
+  if (off < ((uintptr_t)ARENAS * 8 << REGION_SHIFT) && cls < LINE_CLASSES
+      && xcache_count[cls] < xcache_room) {
+    *(void**)ptr = xcache_head[cls];
+    xcache_head[cls] = ptr;
+    xcache_count[cls]++;
+    return;
+  }
+  xfree_slow(ptr);
+}
+
+#else
 
 void* xmalloc(size_t bytes);
 void  xfree(void* ptr);
-void* xrealloc(void* prev, size_t bytes);
+
+#endif
 
 #endif